@@ -1,39 +1,99 @@
 #ifndef SPARKLE_ACTOR_H
 #define SPARKLE_ACTOR_H
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
 #include <thread>
 #include "bounded_buffer.h"
 
 namespace sparkle {
 
+    class Supervisor;
+
     class Actor {
     public:
         struct Context {
             int32_t id = 0;
-            std::string name = "anon";
+            // Shared by all members of a group, whose names are only built on demand.
+            std::shared_ptr<const std::string> base_name;
+            int32_t index = -1;
+            // Unique among the actors of the process, set by the actor. 0 is never used.
+            uint64_t serial = 0;
+
+            // "<base name>-<index>" for members of a group, the base name otherwise.
+            std::string name() const {
+                std::string name = base_name ? *base_name : "anon";
+                return index < 0 ? name : name + "-" + std::to_string(index);
+            }
         };
 
-        Actor(const Context &context,
-              const std::function<void(const Context &)> &on_setup,
-              const std::function<void(const Context &)> &on_shutdown)
-                : context_(context), on_setup_(on_setup), on_shutdown_(on_shutdown) {}
+        explicit Actor(const Context &context) : context_(context) {
+            static std::atomic<uint64_t> next_serial{1};
+            context_.serial = next_serial.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        virtual ~Actor() = default;
+
+        // Runs the actor on its own thread.
+        virtual void Run() {
+            thread_ = std::thread([this] { Body(); });
+        }
+
+        // Runs the actor as a fiber of `simulation`.
+        virtual void Spawn(Simulation &simulation) {
+            simulation.Spawn([this] { Body(); });
+        }
 
-        virtual void Run() = 0;
+        // Called once the simulation the actor was spawned on has ended.
+        virtual void Detach(Simulation &simulation) {}
+
+        virtual void Wait() {
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
 
-        virtual void Wait() = 0;
+        // Runs the actor on the calling thread or simulation fiber until it finishes.
+        virtual void Body() = 0;
 
         int32_t id() {
             return context_.id;
         }
 
         std::string name() {
-            return context_.name;
+            return context_.name();
+        }
+
+        void set_supervisor(const std::shared_ptr<Supervisor> &supervisor) {
+            supervisor_ = supervisor;
+        }
+
+        const std::shared_ptr<Supervisor> &supervisor() {
+            return supervisor_;
+        }
+
+        // Asks the actor to restart with fresh state before it handles its next message.
+        virtual void RequestRestart() {}
+
+        // Context of the actor running on the calling thread, or nullptr outside of actors.
+        static const Context *current() {
+            return static_cast<const Context *>(CurrentContext());
         }
 
     protected:
+        static const void *&CurrentContext() {
+            if (Simulation *simulation = Simulation::current()) {
+                return simulation->local();
+            }
+            thread_local const void *context = nullptr;
+            return context;
+        }
+
         Context context_;
-        std::function<void(const Context &)> on_setup_;
-        std::function<void(const Context &)> on_shutdown_;
+        std::shared_ptr<Supervisor> supervisor_;
+        std::thread thread_;
     };
 
 }
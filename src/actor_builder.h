@@ -5,6 +5,7 @@
 #include "stateful_producer.h"
 #include "reactor.h"
 #include "stateful_reactor.h"
+#include "elastic_group.h"
 
 namespace sparkle {
 
@@ -1,28 +1,179 @@
 #ifndef SPARKLE_ACTOR_SYSTEM_H
 #define SPARKLE_ACTOR_SYSTEM_H
 
+#include <algorithm>
+#include <cassert>
+#include <mutex>
 #include "actor.h"
+#include "latency_histogram.h"
+#include "simulation.h"
+#include "supervisor.h"
 
 namespace sparkle {
 
     class ActorSystem {
     public:
+        // Actors registered after Start() begin running right away.
         template<typename T>
         void Register(const std::shared_ptr<T> &actor) {
-            actors_.push_back(actor);
+            std::lock_guard<std::mutex> lock(mutex_);
+            owners_.push_back(actor);
+            actors_.push_back(actor.get());
+            Launch(actor.get());
+        }
+
+        // Registers actors that stay alive as long as `owner` does.
+        void Register(const std::shared_ptr<void> &owner, const std::vector<Actor *> &actors) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            owners_.push_back(owner);
+            actors_.insert(actors_.end(), actors.begin(), actors.end());
+            for (auto &&actor : actors) {
+                Launch(actor);
+            }
         }
 
         void Start() {
-            for (auto &&actor : actors_) {
-                actor->Run();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                running_ = true;
+                for (auto &&actor : actors_) {
+                    actor->Run();
+                }
             }
-            for (auto &&actor : actors_) {
+            while (true) {
+                Actor *actor;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (waited_ == actors_.size()) {
+                        break;
+                    }
+                    actor = waiting_ = actors_[waited_];
+                }
                 actor->Wait();
+                std::shared_ptr<void> unregistered;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    // Unless it was unregistered meanwhile and the next actor took its place.
+                    if (waited_ < actors_.size() && actors_[waited_] == actor) {
+                        ++waited_;
+                    }
+                    waiting_ = nullptr;
+                    unregistered.swap(unregistered_);
+                }
             }
         }
 
+        // Forgets an actor that has finished, and joins its thread unless Start() is already
+        // waiting for it. Returns false, changing nothing, unless the actor was registered on its
+        // own: members of a group live and die with their arena.
+        template<typename T>
+        bool Unregister(const std::shared_ptr<T> &actor) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                // An owner registered with its own actors never shares an address with one.
+                auto owner = std::find_if(owners_.begin(), owners_.end(),
+                                          [&actor](const std::shared_ptr<void> &owner) {
+                                              return owner.get() == actor.get();
+                                          });
+                auto position = std::find(actors_.begin(), actors_.end(),
+                                          static_cast<Actor *>(actor.get()));
+                if (owner == owners_.end() || position == actors_.end()) {
+                    return false;
+                }
+                if (static_cast<std::size_t>(position - actors_.begin()) < waited_) {
+                    --waited_;
+                }
+                actors_.erase(position);
+                owners_.erase(owner);
+                if (waiting_ == actor.get()) {
+                    // Start() joins it, and must not outlive it.
+                    unregistered_ = actor;
+                    return true;
+                }
+            }
+            actor->Wait();
+            return true;
+        }
+
+        // Runs all actors as fibers of a single-threaded simulation instead of on threads, and
+        // returns once none of them can make progress. The same seed replays the same schedule.
+        void Simulate(uint64_t seed) {
+            Simulation simulation(seed);
+            Simulate(simulation);
+        }
+
+        void Simulate(Simulation &simulation) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                simulation_ = &simulation;
+                for (auto &&actor : actors_) {
+                    actor->Spawn(simulation);
+                }
+            }
+            try {
+                simulation.Run();
+            } catch (...) {
+                EndSimulation(simulation);
+                throw;
+            }
+            EndSimulation(simulation);
+        }
+
+        // Configures the root supervisor, which handles failures of actors whose builders do not
+        // set up supervision and failures escalated by those that do. By default nothing restarts.
+        void Supervise(Supervisor::Strategy strategy,
+                       int32_t max_restarts,
+                       std::chrono::milliseconds within) {
+            supervisor_->Configure(strategy, max_restarts, within);
+        }
+
+        std::shared_ptr<Supervisor> supervisor() {
+            return supervisor_;
+        }
+
+        // Send-to-OnReceive delay of sampled messages from `from` to `to`, or nullptr if no message
+        // on that edge has been sampled yet.
+        const LatencyHistogram *Latency(const std::string &from, const std::string &to) const {
+            return latency_registry_.Find(from, to);
+        }
+
+        std::vector<LatencyRegistry::Edge> LatencyEdges() const {
+            return latency_registry_.Edges();
+        }
+
+        LatencyRegistry &latency_registry() {
+            return latency_registry_;
+        }
+
     private:
-        std::vector<std::shared_ptr<Actor>> actors_;
+        void EndSimulation(Simulation &simulation) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            simulation_ = nullptr;
+            for (auto &&actor : actors_) {
+                actor->Detach(simulation);
+            }
+        }
+
+        void Launch(Actor *actor) {
+            if (simulation_ != nullptr) {
+                actor->Spawn(*simulation_);
+            } else if (running_) {
+                actor->Run();
+            }
+        }
+
+        std::shared_ptr<Supervisor> supervisor_ = std::make_shared<Supervisor>(
+                Supervisor::Strategy::kOneForOne, 0, std::chrono::milliseconds(0));
+        LatencyRegistry latency_registry_;
+        std::mutex mutex_;
+        bool running_ = false;
+        Simulation *simulation_ = nullptr;
+        std::vector<std::shared_ptr<void>> owners_;
+        std::vector<Actor *> actors_;
+        // Start() has waited for actors_[0, waited_) and now waits for `waiting_`.
+        std::size_t waited_ = 0;
+        Actor *waiting_ = nullptr;
+        std::shared_ptr<void> unregistered_;
     };
 
 }
@@ -0,0 +1,72 @@
+#ifndef SPARKLE_ARENA_H
+#define SPARKLE_ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include "block_pool.h"
+
+namespace sparkle {
+
+    /**
+     * Contiguous storage for the actors of a group, constructed in place one after another, plus
+     * a pool for their equally sized mailboxes. Destroying the arena destroys the actors.
+     */
+    template<typename T>
+    class Arena {
+    public:
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Arena cannot over-align actors");
+
+        explicit Arena(std::size_t capacity)
+                : capacity_(capacity),
+                  actors_(static_cast<T *>(::operator new(capacity * sizeof(T)))) {}
+
+        Arena(const Arena &) = delete;
+
+        Arena &operator=(const Arena &) = delete;
+
+        ~Arena() {
+            while (size_ > 0) {
+                actors_[--size_].~T();
+            }
+            ::operator delete(actors_);
+        }
+
+        template<typename... Args>
+        T *Emplace(Args &&... args) {
+            assert(size_ < capacity_);
+            T *actor = new(actors_ + size_) T(std::forward<Args>(args)...);
+            ++size_;
+            return actor;
+        }
+
+        T *Get(std::size_t index) {
+            assert(index < size_);
+            return actors_ + index;
+        }
+
+        std::size_t size() {
+            return size_;
+        }
+
+        // Mailbox storage, one block of `block_size` bytes per actor in a single chunk.
+        BlockPool *mailbox_pool(std::size_t block_size) {
+            if (!mailbox_pool_) {
+                mailbox_pool_.reset(new BlockPool(block_size, capacity_));
+            }
+            assert(mailbox_pool_->block_size() >= block_size);
+            return mailbox_pool_.get();
+        }
+
+    private:
+        std::unique_ptr<BlockPool> mailbox_pool_;
+        std::size_t capacity_;
+        std::size_t size_ = 0;
+        T *actors_;
+    };
+
+}
+
+#endif //SPARKLE_ARENA_H
@@ -0,0 +1,128 @@
+#ifndef SPARKLE_BLOCK_POOL_H
+#define SPARKLE_BLOCK_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace sparkle {
+
+    /**
+     * Hands out equally sized blocks carved from large chunks and recycles returned ones, so
+     * that many mailboxes of the same size live in a few contiguous allocations. Chunks are not
+     * touched until their blocks are used, so untouched pages of a large chunk stay unmapped.
+     */
+    class BlockPool {
+    public:
+        BlockPool(std::size_t block_size, std::size_t blocks_per_chunk)
+                : block_size_(RoundUp(block_size)),
+                  blocks_per_chunk_(blocks_per_chunk > 0 ? blocks_per_chunk : 1) {}
+
+        BlockPool(const BlockPool &) = delete;
+
+        BlockPool &operator=(const BlockPool &) = delete;
+
+        void *Allocate() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_list_ != nullptr) {
+                void *block = free_list_;
+                free_list_ = free_list_->next;
+                return block;
+            }
+            if (next_ == end_) {
+                chunks_.emplace_back(new Block[block_size_ / sizeof(Block) * blocks_per_chunk_]);
+                next_ = reinterpret_cast<char *>(chunks_.back().get());
+                end_ = next_ + block_size_ * blocks_per_chunk_;
+            }
+            void *block = next_;
+            next_ += block_size_;
+            return block;
+        }
+
+        void Deallocate(void *block) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto free_block = static_cast<FreeBlock *>(block);
+            free_block->next = free_list_;
+            free_list_ = free_block;
+        }
+
+        std::size_t block_size() const {
+            return block_size_;
+        }
+
+    private:
+        using Block = std::max_align_t;
+
+        struct FreeBlock {
+            FreeBlock *next;
+        };
+
+        static std::size_t RoundUp(std::size_t size) {
+            std::size_t unit = sizeof(Block);
+            return size == 0 ? unit : (size + unit - 1) / unit * unit;
+        }
+
+        const std::size_t block_size_;
+        const std::size_t blocks_per_chunk_;
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Block[]>> chunks_;
+        char *next_ = nullptr;
+        char *end_ = nullptr;
+        FreeBlock *free_list_ = nullptr;
+    };
+
+    // Takes allocations that fit into a block from `pool`, and everything else from the heap.
+    template<typename T>
+    class PoolAllocator {
+    public:
+        using value_type = T;
+
+        PoolAllocator() = default;
+
+        explicit PoolAllocator(BlockPool *pool) : pool_(pool) {}
+
+        template<typename U>
+        PoolAllocator(const PoolAllocator<U> &other) : pool_(other.pool()) {}
+
+        T *allocate(std::size_t n) {
+            if (FromPool(n)) {
+                return static_cast<T *>(pool_->Allocate());
+            }
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *pointer, std::size_t n) {
+            if (FromPool(n)) {
+                pool_->Deallocate(pointer);
+            } else {
+                ::operator delete(pointer);
+            }
+        }
+
+        BlockPool *pool() const {
+            return pool_;
+        }
+
+        template<typename U>
+        bool operator==(const PoolAllocator<U> &other) const {
+            return pool_ == other.pool();
+        }
+
+        template<typename U>
+        bool operator!=(const PoolAllocator<U> &other) const {
+            return pool_ != other.pool();
+        }
+
+    private:
+        bool FromPool(std::size_t n) const {
+            return pool_ != nullptr && n * sizeof(T) <= pool_->block_size();
+        }
+
+        BlockPool *pool_ = nullptr;
+    };
+
+}
+
+#endif //SPARKLE_BLOCK_POOL_H
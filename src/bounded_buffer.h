@@ -2,9 +2,16 @@
 #define SPARKLE_BOUNDED_BUFFER_H_
 
 #include <boost/circular_buffer.hpp>
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <boost/call_traits.hpp>
 #include <condition_variable>
+#include "block_pool.h"
+#include "segmented_queue.h"
+#include "simulation.h"
+#include "trace.h"
 
 namespace sparkle {
 
@@ -12,7 +19,7 @@ namespace sparkle {
     class bounded_buffer {
     public:
 
-        using buffer_type = boost::circular_buffer<T>;
+        using buffer_type = boost::circular_buffer<T, PoolAllocator<T>>;
         using size_type = typename buffer_type::size_type;
         using value_type = typename buffer_type::value_type;
         using reference = typename buffer_type::reference;
@@ -20,8 +27,25 @@ namespace sparkle {
         using rvalue_type = typename buffer_type::rvalue_type;
         using param_type = typename boost::call_traits<value_type>::const_reference;
 
-        explicit bounded_buffer(size_type capacity)
-                : unread_num_(0), underlying_buffer_(capacity) {}
+        // Enqueue time of a sampled item, and whatever its sender attached. `time` is 0 for
+        // items that were not sampled.
+        struct stamp {
+            int64_t time = 0;
+            void *tag = nullptr;
+        };
+
+        enum class pop_status {
+            popped,
+            closed,
+            timed_out,
+            interrupted,
+        };
+
+        // Items are stored in a block of `pool` if they fit, and on the heap otherwise. The
+        // storage is only allocated by the first push.
+        explicit bounded_buffer(size_type capacity, BlockPool *pool = nullptr)
+                : unread_num_(0), capacity_(capacity),
+                  underlying_buffer_(PoolAllocator<T>(pool)) {}
 
         bounded_buffer(const bounded_buffer &) = delete; // Disabled copy constructor.
         bounded_buffer &operator=(const bounded_buffer &) = delete; // Disabled assign operator.
@@ -32,47 +56,288 @@ namespace sparkle {
 
         bounded_buffer &operator=(bounded_buffer &&other) noexcept {
             unread_num_ = other.unread_num_;
+            capacity_ = other.capacity_;
             underlying_buffer_ = std::move(other.underlying_buffer_);
+            segments_ = std::move(other.segments_);
+            stamps_ = std::move(other.stamps_);
+            pushed_ = other.pushed_;
+            closed_ = other.closed_;
+            interrupted_ = other.interrupted_;
             return *this;
         }
 
-        void push_front(param_type item) {
+        // Stores items in segments of `pool`, taken as the buffer fills up to its capacity and
+        // given back as it drains, instead of in a ring of the full capacity. Must be called
+        // before any item is pushed.
+        void segment(const std::shared_ptr<BlockPool> &pool) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            segments_.reset(new segmented_queue<T>(pool));
+        }
+
+        // Returns false without touching `item` if the buffer has been closed. `trace_id` names
+        // the consumer in the trace events of a push that has to wait.
+        bool push_front(param_type item, const stamp &item_stamp = stamp(),
+                        uint64_t trace_id = 0) {
+            preempt();
             {
                 std::unique_lock<std::mutex> lock(mutex_);
-                not_full_.wait(lock,
-                               [this] { return unread_num_ < underlying_buffer_.capacity(); });
-                underlying_buffer_.push_front(item);
+                wait_not_full(lock, trace_id);
+                if (closed_) {
+                    return false;
+                }
+                store(item);
+                push_stamp(item_stamp);
                 ++unread_num_;
+                ++pushed_;
             }
-            not_empty_.notify_one();
+            NotifyOn(not_empty_, false);
+            return true;
         }
 
-        void push_front(rvalue_type item) {
+        bool push_front(rvalue_type item, const stamp &item_stamp = stamp(),
+                        uint64_t trace_id = 0) {
+            preempt();
             {
                 std::unique_lock<std::mutex> lock(mutex_);
-                not_full_.wait(lock,
-                               [this] { return unread_num_ < underlying_buffer_.capacity(); });
-                underlying_buffer_.push_front(std::move(item));
+                wait_not_full(lock, trace_id);
+                if (closed_) {
+                    return false;
+                }
+                store(std::move(item));
+                push_stamp(item_stamp);
                 ++unread_num_;
+                ++pushed_;
             }
-            not_empty_.notify_one();
+            NotifyOn(not_empty_, false);
+            return true;
         }
 
+        // Returns a default constructed value once the buffer is closed and drained.
         value_type pop_back() {
             value_type result;
+            stamp ignored;
+            pop_back(result, ignored);
+            return result;
+        }
+
+        // Returns false once the buffer is closed and drained.
+        bool pop_back(value_type &result, stamp &item_stamp) {
+            preempt();
             {
                 std::unique_lock<std::mutex> lock(mutex_);
-                not_empty_.wait(lock, [this] { return unread_num_ > 0; });
-                result = std::move(underlying_buffer_[--unread_num_]);
+                wait_not_empty(lock);
+                if (unread_num_ == 0) {
+                    return false;
+                }
+                item_stamp = take_stamp();
+                take(result);
             }
-            not_full_.notify_one();
-            return result;
+            NotifyOn(not_full_, false);
+            return true;
+        }
+
+        // Like pop_back, but gives up once the buffer stayed empty for `timeout`, which may be
+        // nanoseconds::max() to wait without one, or once interrupt() is called.
+        pop_status pop_back(value_type &result, stamp &item_stamp,
+                            std::chrono::nanoseconds timeout) {
+            preempt();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!wait_not_empty(lock, timeout)) {
+                    return pop_status::timed_out;
+                }
+                if (unread_num_ == 0) {
+                    if (interrupted_) {
+                        interrupted_ = false;
+                        return pop_status::interrupted;
+                    }
+                    return pop_status::closed;
+                }
+                item_stamp = take_stamp();
+                take(result);
+            }
+            NotifyOn(not_full_, false);
+            return pop_status::popped;
+        }
+
+        // Makes the next timed pop_back that finds the buffer empty return interrupted instead
+        // of waiting, and wakes the consumer if it already waits.
+        void interrupt() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                interrupted_ = true;
+            }
+            NotifyOn(not_empty_, true);
+        }
+
+        // Frees the storage of an empty buffer until the next push. Returns false, keeping the
+        // storage, if the buffer holds items, has been closed or interrupted.
+        bool release() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (unread_num_ > 0 || closed_ || interrupted_) {
+                return false;
+            }
+            if (segments_) {
+                segments_->release();
+            } else {
+                buffer_type(underlying_buffer_.get_allocator()).swap(underlying_buffer_);
+            }
+            stamps_.reset();
+            return true;
+        }
+
+        // Rejects further pushes. Items already in the buffer can still be popped.
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            NotifyOn(not_empty_, true);
+            NotifyOn(not_full_, true);
+        }
+
+        size_type size() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return unread_num_;
+        }
+
+        size_type capacity() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return capacity_;
+        }
+
+        // Number of items pushed since the buffer was created.
+        uint64_t pushed() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return pushed_;
         }
 
     private:
 
+        struct sampled_item {
+            // Value of pushed_ when the item was pushed.
+            uint64_t seq;
+            stamp item_stamp;
+        };
+
+        template<typename U>
+        void store(U &&item) {
+            if (segments_) {
+                segments_->push_back(std::forward<U>(item));
+                return;
+            }
+            if (underlying_buffer_.capacity() == 0) {
+                underlying_buffer_.set_capacity(capacity_);
+            }
+            underlying_buffer_.push_front(std::forward<U>(item));
+        }
+
+        // Moves the oldest item into `result`.
+        void take(value_type &result) {
+            --unread_num_;
+            if (segments_) {
+                segments_->pop_front(result);
+            } else {
+                result = std::move(underlying_buffer_[unread_num_]);
+            }
+        }
+
+        // Only sampled items keep their stamp, so the stamps take memory in proportion to the
+        // sampled items in the buffer.
+        void push_stamp(const stamp &item_stamp) {
+            if (item_stamp.time == 0) {
+                return;
+            }
+            if (!stamps_) {
+                stamps_.reset(new std::deque<sampled_item>());
+            }
+            stamps_->push_back(sampled_item{pushed_, item_stamp});
+        }
+
+        // Returns the stamp of the oldest item, before it is taken.
+        stamp take_stamp() {
+            if (!stamps_ || stamps_->empty() || stamps_->front().seq != pushed_ - unread_num_) {
+                return stamp();
+            }
+            stamp item_stamp = stamps_->front().item_stamp;
+            stamps_->pop_front();
+            return item_stamp;
+        }
+
+        // Inside a simulation the buffer blocks and wakes fibers instead of threads.
+        static void preempt() {
+            if (Simulation *simulation = Simulation::current()) {
+                simulation->Preempt();
+            }
+        }
+
+        // Returns false if `timeout` passed before `ready` held.
+        template<typename Predicate>
+        static bool wait_for(std::unique_lock<std::mutex> &lock, std::condition_variable &condition,
+                             std::chrono::nanoseconds timeout, Predicate ready) {
+            Simulation *simulation = Simulation::current();
+            if (simulation == nullptr) {
+                return condition.wait_for(lock, timeout, ready);
+            }
+            auto deadline = simulation->now() + timeout;
+            while (!ready()) {
+                auto now = simulation->now();
+                if (now >= deadline) {
+                    return false;
+                }
+                lock.unlock();
+                simulation->WaitFor(&condition, deadline - now);
+                lock.lock();
+            }
+            return true;
+        }
+
+        void wait_not_full(std::unique_lock<std::mutex> &lock, uint64_t trace_id) {
+            if (closed_ || unread_num_ < capacity_) {
+                return;
+            }
+            SPARKLE_TRACE_EVENT(kEnqueueWaitBegin, trace_id);
+            WaitOn(lock, not_full_, [this] {
+                return closed_ || unread_num_ < capacity_;
+            });
+            SPARKLE_TRACE_EVENT(kEnqueueWaitEnd, trace_id);
+        }
+
+        void wait_not_empty(std::unique_lock<std::mutex> &lock) {
+            if (closed_ || unread_num_ > 0) {
+                return;
+            }
+            SPARKLE_TRACE_EVENT(kPark, 0);
+            WaitOn(lock, not_empty_, [this] { return closed_ || unread_num_ > 0; });
+            SPARKLE_TRACE_EVENT(kUnpark, 0);
+        }
+
+        bool wait_not_empty(std::unique_lock<std::mutex> &lock, std::chrono::nanoseconds timeout) {
+            auto ready = [this] { return closed_ || unread_num_ > 0 || interrupted_; };
+            if (ready()) {
+                return true;
+            }
+            SPARKLE_TRACE_EVENT(kPark, 0);
+            if (timeout == std::chrono::nanoseconds::max()) {
+                WaitOn(lock, not_empty_, ready);
+                SPARKLE_TRACE_EVENT(kUnpark, 0);
+                return true;
+            }
+            bool woken = wait_for(lock, not_empty_, timeout, ready);
+            SPARKLE_TRACE_EVENT(kUnpark, 0);
+            return woken;
+        }
+
         size_type unread_num_;
+        size_type capacity_;
         buffer_type underlying_buffer_;
+        // Replaces underlying_buffer_ in segmented buffers.
+        std::unique_ptr<segmented_queue<T>> segments_;
+        // Only allocated by the first sampled push, to keep the many unsampled mailboxes small.
+        std::unique_ptr<std::deque<sampled_item>> stamps_;
+        uint64_t pushed_ = 0;
+        bool closed_ = false;
+        bool interrupted_ = false;
         std::mutex mutex_;
         std::condition_variable not_empty_;
         std::condition_variable not_full_;
@@ -0,0 +1,43 @@
+#ifndef SPARKLE_CONSISTENT_HASH_H
+#define SPARKLE_CONSISTENT_HASH_H
+
+#include <cstdint>
+#include <functional>
+
+namespace sparkle {
+
+    // Lamping & Veach jump consistent hash. Growing from n to n + 1 buckets moves only 1 / (n + 1)
+    // of the keys, all of them to the new bucket; shrinking moves only the keys of the last one.
+    inline int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets) {
+        int64_t bucket = -1;
+        int64_t next = 0;
+        while (next < num_buckets) {
+            bucket = next;
+            key = key * 2862933555777941757ULL + 1;
+            next = static_cast<int64_t>(
+                    static_cast<double>(bucket + 1) *
+                    (static_cast<double>(int64_t(1) << 31) / static_cast<double>((key >> 33) + 1)));
+        }
+        return static_cast<int32_t>(bucket);
+    }
+
+    // The keys that move from member `from` to member `to` of an elastic group when it resizes
+    // from `old_size` to `new_size` members.
+    struct KeyMove {
+        int32_t from;
+        int32_t to;
+        int32_t old_size;
+        int32_t new_size;
+
+        // Whether `key`, as passed to ElasticGroup::Send, is one of them.
+        template<typename K>
+        bool Contains(const K &key) const {
+            uint64_t hash = std::hash<K>()(key);
+            return JumpConsistentHash(hash, old_size) == from &&
+                   JumpConsistentHash(hash, new_size) == to;
+        }
+    };
+
+}
+
+#endif //SPARKLE_CONSISTENT_HASH_H
@@ -0,0 +1,358 @@
+#ifndef SPARKLE_ELASTIC_GROUP_H
+#define SPARKLE_ELASTIC_GROUP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "actor_system.h"
+#include "consistent_hash.h"
+#include "group.h"
+#include "producer.h"
+
+namespace sparkle {
+
+    struct ElasticPolicy {
+        // How often the mailboxes are inspected.
+        std::chrono::milliseconds interval{100};
+        // A reactor is added when the average mailbox is filled above grow_pressure, or when the
+        // reactors spend more than grow_busy of the interval in OnReceive on average.
+        double grow_pressure = 0.5;
+        double grow_busy = 0.8;
+        // The last reactor retires after shrink_after consecutive intervals below both
+        // shrink_pressure and shrink_busy.
+        double shrink_pressure = 0.05;
+        double shrink_busy = 0.3;
+        int32_t shrink_after = 10;
+    };
+
+    /**
+     * A group of reactors whose size follows the load within [min_size, max_size]. Messages are
+     * routed by key with a jump consistent hash, so resizing moves as few keys as possible.
+     *
+     * Whenever keys move, messages for them are held back until every old owner has handled the
+     * messages it already got for them and handed them off, and every new owner has taken them
+     * over, so a key is never handled by two reactors at once. Stateful reactors move the state of
+     * the keys along with StatefulReactor::Builder::HandOffState. A reactor that sends to its own
+     * group may therefore block until its own hand-off is done, and deadlock.
+     *
+     * A retiring reactor leaves the group once the senders that may have routed to it are done,
+     * then finishes its mailbox, hands its keys off and runs its OnShutdown hook. A later tick of
+     * the scaler reclaims it.
+     */
+    template<typename T>
+    class ElasticGroup {
+    public:
+        using message_type = typename T::message_type;
+        using Factory = std::function<std::shared_ptr<T>(const Actor::Context &)>;
+
+        ElasticGroup(ActorSystem &actor_system,
+                     const std::shared_ptr<const std::string> &base_name,
+                     std::size_t min_size,
+                     std::size_t max_size,
+                     const ElasticPolicy &policy,
+                     const Factory &factory)
+                : shared_(std::make_shared<Shared>(actor_system, base_name, min_size, max_size,
+                                                   policy, factory)) {
+            assert(min_size > 0 && min_size <= max_size);
+            for (std::size_t i = 0; i < min_size; ++i) {
+                shared_->Add();
+            }
+            auto shared = shared_;
+            Producer::Builder(actor_system)
+                    .Name(Actor::Context{0, base_name}.name() + "-scaler")
+                    .OnRun([shared] {
+                        if (Simulation *simulation = Simulation::current()) {
+                            simulation->Background();
+                        }
+                        while (true) {
+                            SleepFor(shared->policy.interval);
+                            bool expected = false;
+                            if (!shared->scaling.compare_exchange_strong(expected, true)) {
+                                return;
+                            }
+                            shared->Tick();
+                            shared->scaling.store(false);
+                            // Stop may have found the scaler busy.
+                            shared->StopOnce();
+                        }
+                    })
+                    .Create();
+        }
+
+        // Returns false once the group has stopped.
+        template<typename K>
+        bool Send(const K &key, const message_type &message) {
+            Sender sender(*shared_, std::hash<K>()(key));
+            return sender.reactor()->Send(message);
+        }
+
+        template<typename K>
+        bool Send(const K &key, message_type &&message) {
+            Sender sender(*shared_, std::hash<K>()(key));
+            return sender.reactor()->Send(std::move(message));
+        }
+
+        // Stops every reactor once the keys that are moving have been handed off, see
+        // Reactor::Stop.
+        void Stop() {
+            shared_->stopped.store(true);
+            shared_->StopOnce();
+        }
+
+        size_t size() {
+            return shared_->size.load(std::memory_order_acquire);
+        }
+
+    private:
+        struct Slot {
+            std::atomic<T *> reactor{nullptr};
+            // Senders between routing to the reactor and pushing to it, by parity of the epoch
+            // they entered in.
+            std::atomic<int64_t> senders[2] = {{0}, {0}};
+        };
+
+        struct Shared {
+            Shared(ActorSystem &actor_system, const std::shared_ptr<const std::string> &base_name,
+                   std::size_t min_size, std::size_t max_size, const ElasticPolicy &policy,
+                   const Factory &factory)
+                    : actor_system(actor_system), base_name(base_name), min_size(min_size),
+                      max_size(max_size), policy(policy), factory(factory),
+                      slots(new Slot[max_size]), last_busy_time(max_size, 0) {}
+
+            // Only used before any message is sent.
+            void Add() {
+                std::size_t index = size.load(std::memory_order_relaxed);
+                slots[index].reactor.store(NewReactor(index), std::memory_order_release);
+                size.store(index + 1);
+            }
+
+            // Every reactor hands the keys that move to the new one over.
+            void Grow() {
+                auto old_size = static_cast<int32_t>(size.load(std::memory_order_relaxed));
+                T *added = NewReactor(old_size);
+                slots[old_size].reactor.store(added, std::memory_order_release);
+                BeginRebalance(old_size, old_size + 1);
+                pending_hand_offs.store(old_size);
+                for (int32_t i = 0; i < old_size; ++i) {
+                    reactors[i]->HandOff(*added, {i, old_size, old_size, old_size + 1},
+                                         [this] { HandOffDone(); });
+                }
+            }
+
+            // The last reactor hands its keys over to the others and retires.
+            void Shrink() {
+                auto old_size = static_cast<int32_t>(size.load(std::memory_order_relaxed));
+                int32_t new_size = old_size - 1;
+                // Once the senders that routed to the last reactor before are done, no sender
+                // holds it, and a stopped reactor would refuse their messages.
+                BeginRebalance(old_size, new_size);
+                T *retiring = reactors.back().get();
+                pending_hand_offs.store(new_size);
+                for (int32_t i = 0; i < new_size; ++i) {
+                    retiring->HandOff(*reactors[i], {new_size, i, old_size, new_size},
+                                      [this] { HandOffDone(); });
+                }
+                retiring->Stop();
+                retired.push_back(std::move(reactors.back()));
+                reactors.pop_back();
+            }
+
+            T *NewReactor(std::size_t index) {
+                int32_t id = next_id++;
+                auto reactor = factory({id, base_name, id});
+                reactor->MeasureBusyTime();
+                last_busy_time[index] = reactor->busy_time();
+                reactors.push_back(reactor);
+                return reactor.get();
+            }
+
+            // Holds back the keys that move, resizes, and waits for the senders that may have
+            // routed them the old way.
+            void BeginRebalance(int32_t old_size, int32_t new_size) {
+                rebalance.store(static_cast<uint64_t>(old_size) << 32 |
+                                static_cast<uint32_t>(new_size));
+                size.store(new_size);
+                Quiesce();
+            }
+
+            // Called on the thread of the new owner of some keys once it has taken them over.
+            void HandOffDone() {
+                if (pending_hand_offs.fetch_sub(1) > 1) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(held_mutex);
+                    rebalance.store(0);
+                }
+                NotifyOn(held_condition, true);
+            }
+
+            // Whether messages for the key with `hash` are held back.
+            bool Held(uint64_t hash) {
+                uint64_t sizes = rebalance.load();
+                if (sizes == 0) {
+                    return false;
+                }
+                auto old_size = static_cast<int32_t>(sizes >> 32);
+                auto new_size = static_cast<int32_t>(sizes & 0xffffffff);
+                return JumpConsistentHash(hash, old_size) != JumpConsistentHash(hash, new_size);
+            }
+
+            void AwaitRebalance() {
+                std::unique_lock<std::mutex> lock(held_mutex);
+                WaitOn(lock, held_condition, [this] { return rebalance.load() == 0; });
+            }
+
+            // Waits for the senders that entered before the call.
+            void Quiesce() {
+                uint64_t parity = epoch.fetch_add(1) & 1;
+                for (std::size_t i = 0; i < max_size; ++i) {
+                    while (slots[i].senders[parity].load() != 0) {
+                        SleepFor(std::chrono::microseconds(20));
+                    }
+                }
+            }
+
+            // Joins the retired reactors that have finished, and forgets them.
+            void Reclaim() {
+                auto finished = std::partition(retired.begin(), retired.end(),
+                                               [](const std::shared_ptr<T> &reactor) {
+                                                   return !reactor->finished();
+                                               });
+                for (auto it = finished; it != retired.end(); ++it) {
+                    bool unregistered = actor_system.Unregister(*it);
+                    assert(unregistered);
+                    (void) unregistered;
+                    if (auto &&supervisor = (*it)->supervisor()) {
+                        supervisor->Abandon(it->get());
+                    }
+                }
+                retired.erase(finished, retired.end());
+            }
+
+            // Either the scaler or Stop stops the reactors, whichever gets to it first.
+            void StopOnce() {
+                bool expected = false;
+                if (!stopped.load() || !scaling.compare_exchange_strong(expected, true)) {
+                    return;
+                }
+                AwaitRebalance();
+                for (auto &&reactor : reactors) {
+                    reactor->Stop();
+                }
+            }
+
+            void Tick() {
+                Reclaim();
+                std::size_t current_size = size.load(std::memory_order_relaxed);
+                auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        policy.interval).count();
+                double pressure = 0;
+                double busy = 0;
+                for (std::size_t i = 0; i < current_size; ++i) {
+                    T *reactor = reactors[i].get();
+                    pressure += static_cast<double>(reactor->mailbox_depth()) /
+                                static_cast<double>(reactor->mailbox_capacity());
+                    int64_t busy_time = reactor->busy_time();
+                    busy += static_cast<double>(busy_time - last_busy_time[i]) / interval;
+                    last_busy_time[i] = busy_time;
+                }
+                if (rebalance.load() != 0 || stopped.load()) {
+                    return;
+                }
+                pressure /= current_size;
+                busy /= current_size;
+                if ((pressure > policy.grow_pressure || busy > policy.grow_busy) &&
+                    current_size < max_size) {
+                    Grow();
+                    quiet_ticks = 0;
+                } else if (pressure < policy.shrink_pressure && busy < policy.shrink_busy &&
+                           current_size > min_size) {
+                    if (++quiet_ticks >= policy.shrink_after) {
+                        Shrink();
+                        quiet_ticks = 0;
+                    }
+                } else {
+                    quiet_ticks = 0;
+                }
+            }
+
+            ActorSystem &actor_system;
+            const std::shared_ptr<const std::string> base_name;
+            const std::size_t min_size;
+            const std::size_t max_size;
+            const ElasticPolicy policy;
+            Factory factory;
+            std::unique_ptr<Slot[]> slots;
+            std::atomic<std::size_t> size{0};
+            std::atomic<uint64_t> epoch{0};
+            std::atomic<bool> stopped{false};
+            // Set while the scaler ticks, and for good once the reactors are stopped.
+            std::atomic<bool> scaling{false};
+            // Old size << 32 | new size while keys move, 0 otherwise.
+            std::atomic<uint64_t> rebalance{0};
+            std::atomic<int32_t> pending_hand_offs{0};
+            std::mutex held_mutex;
+            std::condition_variable held_condition;
+            // Only touched by the constructor and whoever holds `scaling`. reactors[i] is in
+            // slots[i].
+            std::vector<std::shared_ptr<T>> reactors;
+            // Stopped, but not finished yet.
+            std::vector<std::shared_ptr<T>> retired;
+            std::vector<int64_t> last_busy_time;
+            int32_t next_id = 0;
+            int32_t quiet_ticks = 0;
+        };
+
+        // Keeps the reactor a key routes to in the group until the message is pushed.
+        class Sender {
+        public:
+            Sender(Shared &shared, uint64_t hash) {
+                while (true) {
+                    epoch_ = shared.epoch.load();
+                    // The size first: a rebalance is announced before the size changes.
+                    auto size = static_cast<int32_t>(shared.size.load());
+                    if (shared.Held(hash)) {
+                        shared.AwaitRebalance();
+                        continue;
+                    }
+                    slot_ = &shared.slots[JumpConsistentHash(hash, size)];
+                    slot_->senders[epoch_ & 1].fetch_add(1);
+                    // Otherwise Quiesce may have missed this sender.
+                    if (shared.epoch.load() == epoch_) {
+                        return;
+                    }
+                    slot_->senders[epoch_ & 1].fetch_sub(1);
+                }
+            }
+
+            Sender(const Sender &) = delete;
+
+            Sender &operator=(const Sender &) = delete;
+
+            ~Sender() {
+                slot_->senders[epoch_ & 1].fetch_sub(1);
+            }
+
+            T *reactor() {
+                return slot_->reactor.load(std::memory_order_acquire);
+            }
+
+        private:
+            uint64_t epoch_;
+            Slot *slot_;
+        };
+
+        std::shared_ptr<Shared> shared_;
+    };
+
+}
+
+#endif //SPARKLE_ELASTIC_GROUP_H
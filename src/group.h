@@ -4,9 +4,15 @@
 #include <vector>
 #include "actor.h"
 #include "actor_system.h"
+#include "arena.h"
 
 namespace sparkle {
 
+    template<typename T>
+    class ElasticGroup;
+
+    struct ElasticPolicy;
+
     template<typename T>
     class Group {
     public:
@@ -17,56 +23,110 @@ namespace sparkle {
         public:
             virtual std::shared_ptr<T> CreateWithContext(const Actor::Context &context) = 0;
 
+            // Constructs an actor in `arena` without registering it.
+            virtual T *CreateInArena(Arena<T> &arena, const Actor::Context &context) = 0;
+
             std::shared_ptr<T> Create() {
-                return CreateWithContext({});
+                return CreateWithContext(context_);
             }
 
+            // Creates all actors of the group in one arena, sharing the handlers, the name and
+            // the supervisor, and registers them at once.
             Group<T> CreateGroup(std::size_t size) {
-                std::vector<std::shared_ptr<T>> actors;
+                auto arena = std::make_shared<Arena<T>>(size);
+                auto supervisor = NewSupervisor();
+                std::vector<Actor *> actors;
+                actors.reserve(size);
                 for (int32_t i = 0; i < size; ++i) {
-                    actors.push_back(
-                            CreateWithContext({i, context_.name + "-" + std::to_string(i)}));
+                    T *actor = CreateInArena(*arena, {i, context_.base_name, i});
+                    actor->set_supervisor(supervisor);
+                    actors.push_back(actor);
                 }
-                return {actors};
+                supervisor->Adopt(actors);
+                actor_system_.Register(arena, actors);
+                return {arena};
+            }
+
+            ElasticGroup<T> CreateElasticGroup(std::size_t min_size, std::size_t max_size) {
+                return CreateElasticGroup(min_size, max_size, ElasticPolicy());
+            }
+
+            ElasticGroup<T> CreateElasticGroup(std::size_t min_size, std::size_t max_size,
+                                               const ElasticPolicy &policy) {
+                Self builder = static_cast<Self &>(*this);
+                static_cast<Builder &>(builder).group_supervisor_ = NewSupervisor();
+                return {actor_system_, context_.base_name, min_size, max_size, policy,
+                        [builder](const Actor::Context &context) mutable {
+                            return builder.CreateWithContext(context);
+                        }};
             }
 
             Self Id(int32_t id) {
                 context_.id = id;
-                return *this;
+                return static_cast<Self &>(*this);
             }
 
             Self Name(std::string name) {
-                context_.name = name;
-                return *this;
+                context_.base_name = std::make_shared<const std::string>(std::move(name));
+                return static_cast<Self &>(*this);
+            }
+
+            // Supervises the created actor, or all actors of a created group together, instead of
+            // leaving their failures to the actor system's root supervisor.
+            Self Supervise(Supervisor::Strategy strategy,
+                           int32_t max_restarts,
+                           std::chrono::milliseconds within) {
+                supervised_ = true;
+                strategy_ = strategy;
+                max_restarts_ = max_restarts;
+                within_ = within;
+                return static_cast<Self &>(*this);
             }
 
         protected:
             Builder(ActorSystem &actor_system) : actor_system_(actor_system) {}
 
             void Register(std::shared_ptr<T> actor) {
+                auto supervisor = group_supervisor_ ? group_supervisor_ : NewSupervisor();
+                supervisor->Adopt(actor.get());
+                actor->set_supervisor(supervisor);
                 actor_system_.Register(actor);
             }
 
+            ActorSystem &actor_system() {
+                return actor_system_;
+            }
+
         private:
+            std::shared_ptr<Supervisor> NewSupervisor() {
+                if (!supervised_) {
+                    return actor_system_.supervisor();
+                }
+                return std::make_shared<Supervisor>(strategy_, max_restarts_, within_,
+                                                    actor_system_.supervisor());
+            }
+
             ActorSystem &actor_system_;
             Actor::Context context_;
+            bool supervised_ = false;
+            Supervisor::Strategy strategy_ = Supervisor::Strategy::kOneForOne;
+            int32_t max_restarts_ = 0;
+            std::chrono::milliseconds within_{0};
+            std::shared_ptr<Supervisor> group_supervisor_;
         };
 
-        Group(const std::vector<std::shared_ptr<T>> &actors) : size_(actors.size()),
-                                                               actors_(actors) {}
+        Group(const std::shared_ptr<Arena<T>> &arena) : arena_(arena) {}
 
         std::shared_ptr<T> Get(size_t id) {
-            assert(id >= 0 && id < size_);
-            return actors_[id];
+            return std::shared_ptr<T>(arena_, arena_->Get(id));
         }
 
         size_t size() {
-            return size_;
+            return arena_->size();
         }
 
     private:
-        size_t size_;
-        std::vector<std::shared_ptr<T>> actors_;
+        std::shared_ptr<Arena<T>> arena_;
     };
 
 }
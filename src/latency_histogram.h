@@ -0,0 +1,148 @@
+#ifndef SPARKLE_LATENCY_HISTOGRAM_H
+#define SPARKLE_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sparkle {
+
+    /**
+     * Lock-free histogram of nanosecond latencies with HDR-style log-linear buckets: every power
+     * of two is split into kSubBuckets linear buckets, so a recorded value is reported with a
+     * relative error of at most 1 / kSubBuckets.
+     */
+    class LatencyHistogram {
+    public:
+        static constexpr int kSubBucketBits = 5;
+        static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+        static constexpr std::size_t kBucketCount = (65 - kSubBucketBits) * kSubBuckets;
+
+        LatencyHistogram() {
+            for (auto &&count : counts_) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        LatencyHistogram(const LatencyHistogram &) = delete;
+
+        LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+        void Record(int64_t nanoseconds) {
+            uint64_t value = nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0;
+            counts_[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            uint64_t max = max_.load(std::memory_order_relaxed);
+            while (value > max &&
+                   !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+        }
+
+        uint64_t count() const {
+            return count_.load(std::memory_order_relaxed);
+        }
+
+        int64_t max() const {
+            return static_cast<int64_t>(max_.load(std::memory_order_relaxed));
+        }
+
+        /**
+         * Returns the smallest recorded latency, up to bucket resolution, that is greater than
+         * or equal to `percentile` percent of the samples, or 0 if nothing was recorded.
+         */
+        int64_t Percentile(double percentile) const {
+            uint64_t total = count();
+            if (total == 0) {
+                return 0;
+            }
+            // Rounded up like HDR histograms do, so that e.g. p99 of 150 samples is the 149th.
+            // Multiplying first keeps whole percentiles of round counts exact.
+            auto rank = static_cast<uint64_t>(
+                    std::ceil(percentile * static_cast<double>(total) / 100.0));
+            rank = rank == 0 ? 1 : (rank > total ? total : rank);
+            uint64_t seen = 0;
+            for (std::size_t i = 0; i < kBucketCount; ++i) {
+                seen += counts_[i].load(std::memory_order_relaxed);
+                if (seen >= rank) {
+                    uint64_t upper = UpperBoundOf(i);
+                    uint64_t max = max_.load(std::memory_order_relaxed);
+                    return static_cast<int64_t>(upper < max ? upper : max);
+                }
+            }
+            return max();
+        }
+
+    private:
+        static std::size_t IndexOf(uint64_t value) {
+            if (value < kSubBuckets) {
+                return static_cast<std::size_t>(value);
+            }
+            int magnitude = 63 - __builtin_clzll(value);
+            int shift = magnitude - kSubBucketBits;
+            return static_cast<std::size_t>((shift + 1) * kSubBuckets +
+                                            ((value >> shift) - kSubBuckets));
+        }
+
+        static uint64_t UpperBoundOf(std::size_t index) {
+            if (index < kSubBuckets) {
+                return index;
+            }
+            int shift = static_cast<int>(index / kSubBuckets) - 1;
+            uint64_t lower = (kSubBuckets + index % kSubBuckets) << shift;
+            return lower + ((uint64_t(1) << shift) - 1);
+        }
+
+        std::atomic<uint64_t> counts_[kBucketCount];
+        std::atomic<uint64_t> count_{0};
+        std::atomic<uint64_t> max_{0};
+    };
+
+    /**
+     * Histograms of the delay from Send to the start of OnReceive, keyed by the names of the
+     * sending and the receiving actor. Messages sent from outside any actor come from "external".
+     */
+    class LatencyRegistry {
+    public:
+        struct Edge {
+            std::string from;
+            std::string to;
+            const LatencyHistogram *histogram;
+        };
+
+        LatencyHistogram *Get(const std::string &from, const std::string &to) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto &&histogram = histograms_[std::make_pair(from, to)];
+            if (!histogram) {
+                histogram.reset(new LatencyHistogram());
+            }
+            return histogram.get();
+        }
+
+        const LatencyHistogram *Find(const std::string &from, const std::string &to) const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = histograms_.find(std::make_pair(from, to));
+            return it == histograms_.end() ? nullptr : it->second.get();
+        }
+
+        std::vector<Edge> Edges() const {
+            std::vector<Edge> edges;
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &&entry : histograms_) {
+                edges.push_back({entry.first.first, entry.first.second, entry.second.get()});
+            }
+            return edges;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::pair<std::string, std::string>, std::unique_ptr<LatencyHistogram>> histograms_;
+    };
+
+}
+
+#endif //SPARKLE_LATENCY_HISTOGRAM_H
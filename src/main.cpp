@@ -1,6 +1,7 @@
 #include <memory>
 
 #include <iostream>
+#include <unordered_map>
 #include <thread>
 #include <boost/progress.hpp>
 #include "bounded_buffer.h"
@@ -171,6 +172,164 @@ void test_group() {
     actor_system.Start();
 }
 
+struct KeyedState {
+    std::unordered_map<int64_t, int64_t> sums;
+};
+
+void test_elastic_group() {
+    sparkle::ActorSystem actor_system;
+    auto &&consumers = sparkle::reactor<std::unique_ptr<Message>, KeyedState>(actor_system)
+            .Name("consumer")
+            .MailboxSize(QUEUE_SIZE)
+            .OnReceive(
+                    [](std::unique_ptr<Message> &message, KeyedState &state) {
+                        state.sums[message->data % QUEUE_SIZE] += message->data;
+                    })
+            .HandOffState(
+                    [](KeyedState &state, const sparkle::KeyMove &move) {
+                        KeyedState moving;
+                        for (auto it = state.sums.begin(); it != state.sums.end();) {
+                            if (move.Contains(it->first)) {
+                                moving.sums.insert(*it);
+                                it = state.sums.erase(it);
+                            } else {
+                                ++it;
+                            }
+                        }
+                        return moving;
+                    },
+                    [](KeyedState &state, KeyedState &moving, const sparkle::KeyMove &move) {
+                        state.sums.insert(moving.sums.begin(), moving.sums.end());
+                    })
+            .OnShutdownWithContext(
+                    [](KeyedState &state, const sparkle::Actor::Context &context) {
+                        std::cout << context.name() << " retired with " << state.sums.size()
+                                  << " keys" << std::endl;
+                    })
+            .CreateElasticGroup(1, 8);
+    auto &&producer = sparkle::producer(actor_system)
+            .OnRun(
+                    [&consumers] {
+                        for (int64_t i = 0L; i < TOTAL_ELEMENTS; ++i) {
+                            consumers.Send(i % QUEUE_SIZE, std::make_unique<Message>(i));
+                        }
+                        std::cout << "size at peak: " << consumers.size() << std::endl;
+                        consumers.Stop();
+                    })
+            .Create();
+    actor_system.Start();
+}
+
+struct Hash {
+    uint64_t value = 0;
+};
+
+// Hashes the order in which the consumer gets the messages of two producers.
+uint64_t simulate(uint64_t seed) {
+    sparkle::ActorSystem actor_system;
+    uint64_t hash = 0;
+    auto &&consumer = sparkle::reactor<int64_t, Hash>(actor_system)
+            .MailboxSize(QUEUE_SIZE)
+            .OnReceive(
+                    [](int64_t &x, Hash &state) {
+                        state.value = state.value * 31 + static_cast<uint64_t>(x);
+                    })
+            .OnShutdown(
+                    [&hash](Hash &state) {
+                        hash = state.value;
+                    })
+            .Create();
+    std::atomic<int32_t> running(2);
+    auto &&producers = sparkle::producer(actor_system)
+            .OnRunWithContext(
+                    [&consumer, &running](const sparkle::Actor::Context &context) {
+                        for (int64_t i = 0L; i < TOTAL_ELEMENTS; ++i) {
+                            consumer->Send(i * 2 + context.id);
+                        }
+                        if (running.fetch_sub(1) == 1) {
+                            consumer->Stop();
+                        }
+                    })
+            .CreateGroup(2);
+    actor_system.Simulate(seed);
+    return hash;
+}
+
+void test_simulation() {
+    uint64_t first = simulate(42);
+    uint64_t second = simulate(42);
+    std::cout << "seed 42: " << first << ", replayed: " << second << std::endl;
+}
+
+void test_passivation() {
+    sparkle::ActorSystem actor_system;
+    auto &&counters = sparkle::reactor<int64_t, State>(actor_system)
+            .MailboxSize(QUEUE_SIZE)
+            .PassivateAfter(std::chrono::milliseconds(10))
+            .SerializeState(
+                    [](const State &state) {
+                        return std::to_string(state.counter);
+                    },
+                    [](const std::string &saved) {
+                        State state;
+                        state.counter = std::stoll(saved);
+                        return state;
+                    })
+            .OnReceive(
+                    [](int64_t &x, State &state) {
+                        state.counter += x;
+                    })
+            .OnShutdownWithContext(
+                    [](State &state, const sparkle::Actor::Context &context) {
+                        if (state.counter != 0) {
+                            std::cout << context.name() << ": " << state.counter << std::endl;
+                        }
+                    })
+            .Name("counter")
+            .CreateGroup(100000);
+    auto &&producer = sparkle::producer(actor_system)
+            .OnRun(
+                    [&counters] {
+                        for (int64_t round = 0L; round < 3; ++round) {
+                            for (int64_t i = 0L; i < 10; ++i) {
+                                counters.Get(i * 1000)->Send(i);
+                            }
+                            sparkle::SleepFor(std::chrono::milliseconds(100));
+                        }
+                        for (size_t i = 0; i < counters.size(); ++i) {
+                            counters.Get(i)->Stop();
+                        }
+                    })
+            .Create();
+    actor_system.Simulate(42);
+}
+
+void test_segmented_mailbox() {
+    sparkle::ActorSystem actor_system;
+    auto &&consumer = sparkle::reactor<std::unique_ptr<Message>, State>(actor_system)
+            .MailboxSize(QUEUE_SIZE * 100)
+            .SegmentedMailbox(64)
+            .OnReceive(
+                    [](std::unique_ptr<Message> &message, State &state) {
+                        state.counter += message->data;
+                    })
+            .OnShutdown(
+                    [](State &state) {
+                        std::cout << state.counter << std::endl;
+                    })
+            .Create();
+    auto &&producer = sparkle::producer(actor_system)
+            .OnRun(
+                    [&consumer] {
+                        for (int64_t i = 0L; i < TOTAL_ELEMENTS; ++i) {
+                            consumer->Send(std::make_unique<Message>(i));
+                        }
+                        consumer->Stop();
+                    })
+            .Create();
+    actor_system.Start();
+}
+
 int main() {
     boost::progress_timer progress;
 
@@ -181,6 +340,10 @@ int main() {
 //  test_shared_ptr();
     test_stateful();
 //  test_group();
+//  test_elastic_group();
+//  test_simulation();
+//  test_passivation();
+//  test_segmented_mailbox();
 
     return 0;
 }
@@ -13,26 +13,39 @@ namespace sparkle {
 
         class Builder;
 
-        Producer(const Context &context,
-                 const std::function<void(const Context &)> &on_setup,
-                 const std::function<void(const Context &)> &on_shutdown,
-                 const std::function<void(const Context &)> &on_run)
-                : Actor(context, on_setup, on_shutdown), on_run_(on_run) {}
-
-        void Run() {
-            thread_ = std::thread([this] {
-                on_setup_(context_);
-                on_run_(context_);
-            });
+        // Shared by every producer created from the same builder configuration.
+        struct Handlers {
+            std::function<void(const Context &)> on_setup = [](const Context &) {};
+            std::function<void(const Context &)> on_shutdown = [](const Context &) {};
+            std::function<void(const Context &)> on_run = [](const Context &) {};
+        };
+
+        Producer(const Context &context, const std::shared_ptr<const Handlers> &handlers)
+                : Actor(context), handlers_(handlers) {}
+
+        void Body() override {
+            SPARKLE_TRACE_THREAD(context_.name(), context_.serial);
+            CurrentContext() = &context_;
+            HandleSetup();
+            HandleRun();
+            HandleShutdown();
         }
 
-        void Wait() {
-            thread_.join();
+    protected:
+        virtual void HandleSetup() {
+            handlers_->on_setup(context_);
+        }
+
+        virtual void HandleShutdown() {
+            handlers_->on_shutdown(context_);
+        }
+
+        virtual void HandleRun() {
+            handlers_->on_run(context_);
         }
 
     private:
-        std::thread thread_;
-        std::function<void(const Context &)> on_run_;
+        std::shared_ptr<const Handlers> handlers_;
     };
 
     class Producer::Builder : public Group<Producer>::template Builder<Producer::Builder> {
@@ -41,12 +54,10 @@ namespace sparkle {
         using BaseBuilder = typename Group<Producer>::template Builder<Producer::Builder>;
 
         Builder(ActorSystem &actor_system)
-                : BaseBuilder(actor_system), on_setup_([](const Context &) {}),
-                  on_shutdown_([](const Context &) {}),
-                  on_run_([](const Context &) {}) {}
+                : BaseBuilder(actor_system), handlers_(std::make_shared<Handlers>()) {}
 
         Builder OnSetupWithContext(const std::function<void(const Context &)> &on_setup) {
-            on_setup_ = on_setup;
+            mutable_handlers().on_setup = on_setup;
             return *this;
         }
 
@@ -55,7 +66,7 @@ namespace sparkle {
         }
 
         Builder OnShutdownWithContext(const std::function<void(const Context &)> &on_shutdown) {
-            on_shutdown_ = on_shutdown;
+            mutable_handlers().on_shutdown = on_shutdown;
             return *this;
         }
 
@@ -64,7 +75,7 @@ namespace sparkle {
         }
 
         Builder OnRunWithContext(const std::function<void(const Context &)> &on_run) {
-            on_run_ = on_run;
+            mutable_handlers().on_run = on_run;
             return *this;
         }
 
@@ -72,17 +83,25 @@ namespace sparkle {
             return OnRunWithContext([on_run](const Context &) { on_run(); });
         }
 
-        std::shared_ptr<Producer> CreateWithContext(const Context &context) {
-            auto producer = std::make_shared<Producer>(
-                    Producer(context, on_setup_, on_shutdown_, on_run_));
+        std::shared_ptr<Producer> CreateWithContext(const Context &context) override {
+            auto producer = std::make_shared<Producer>(context, handlers_);
             Register(producer);
             return producer;
         }
 
+        Producer *CreateInArena(Arena<Producer> &arena, const Context &context) override {
+            return arena.Emplace(context, handlers_);
+        }
+
     private:
-        std::function<void(const Context &)> on_setup_;
-        std::function<void(const Context &)> on_shutdown_;
-        std::function<void(const Context &)> on_run_;
+        // Copies of a builder share their handlers until one of them changes a handler.
+        Handlers &mutable_handlers() {
+            auto handlers = std::make_shared<Handlers>(*handlers_);
+            handlers_ = handlers;
+            return *handlers;
+        }
+
+        std::shared_ptr<const Handlers> handlers_;
     };
 
 }
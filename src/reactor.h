@@ -1,8 +1,19 @@
 #ifndef SPARKLE_REACTOR_H
 #define SPARKLE_REACTOR_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include "actor.h"
+#include "consistent_hash.h"
 #include "group.h"
+#include "latency_histogram.h"
+#include "supervisor.h"
 
 namespace sparkle {
 
@@ -10,6 +21,14 @@ namespace sparkle {
     class Reactor : public Actor {
     public:
         using Context = typename Actor::Context;
+        using message_type = T;
+
+        // Shared by every reactor created from the same builder configuration.
+        struct Handlers {
+            std::function<void(const Context &)> on_setup = [](const Context &) {};
+            std::function<void(const Context &)> on_shutdown = [](const Context &) {};
+            std::function<void(T &, const Context &)> on_receive = [](T &, const Context &) {};
+        };
 
         class Builder : public Group<Reactor<T>>::template Builder<Builder> {
         public:
@@ -17,17 +36,46 @@ namespace sparkle {
             using BaseBuilder = typename Group<Reactor<T>>::template Builder<Builder>;
 
             Builder(ActorSystem &actor_system) : BaseBuilder(actor_system), mailbox_size_{0},
-                                                 on_setup_([](const Context &) {}),
-                                                 on_shutdown_([](const Context &) {}),
-                                                 on_receive_([](T &, const Context &) {}) {}
+                                                 latency_sample_period_{0}, lazy_{false},
+                                                 idle_timeout_{0},
+                                                 handlers_(std::make_shared<Handlers>()) {}
 
             Builder MailboxSize(size_type mailbox_size) {
                 mailbox_size_ = mailbox_size;
                 return *this;
             }
 
+            // Grows the mailboxes a segment of `segment_size` messages at a time, up to
+            // MailboxSize, instead of allocating MailboxSize up front. The segments come from a
+            // pool shared by all reactors created by this builder.
+            Builder SegmentedMailbox(size_type segment_size) {
+                segment_pool_ = segmented_queue<T>::make_pool(segment_size);
+                return *this;
+            }
+
+            // Records the queueing delay of every `period`-th message into the actor system's
+            // per-edge latency histograms.
+            Builder SampleLatency(size_type period) {
+                latency_sample_period_ = period;
+                return *this;
+            }
+
+            // Starts the reactor with its first message, see Reactor::Lazy.
+            Builder Lazy() {
+                lazy_ = true;
+                return *this;
+            }
+
+            // Starts the reactor with its first message and passivates it after `idle_timeout`
+            // without messages, see Reactor::Lazy.
+            Builder PassivateAfter(std::chrono::milliseconds idle_timeout) {
+                lazy_ = true;
+                idle_timeout_ = idle_timeout;
+                return *this;
+            }
+
             Builder OnSetupWithContext(const std::function<void(const Context &)> &on_setup) {
-                on_setup_ = on_setup;
+                mutable_handlers().on_setup = on_setup;
                 return *this;
             }
 
@@ -36,7 +84,7 @@ namespace sparkle {
             }
 
             Builder OnShutdownWithContext(const std::function<void(const Context &)> &on_shutdown) {
-                on_shutdown_ = on_shutdown;
+                mutable_handlers().on_shutdown = on_shutdown;
                 return *this;
             }
 
@@ -46,7 +94,7 @@ namespace sparkle {
 
             Builder
             OnReceiveWithContext(const std::function<void(T &, const Context &)> &on_receive) {
-                on_receive_ = on_receive;
+                mutable_handlers().on_receive = on_receive;
                 return *this;
             }
 
@@ -55,59 +103,522 @@ namespace sparkle {
                         [on_receive](T &message, const Context &) { on_receive(message); });
             }
 
-            std::shared_ptr<Reactor> CreateWithContext(const Context &context) {
+            std::shared_ptr<Reactor> CreateWithContext(const Context &context) override {
                 assert(mailbox_size_ > 0);
-                auto reactor = std::make_shared<Reactor>(
-                        Reactor(context, mailbox_size_, on_setup_, on_shutdown_, on_receive_));
+                auto reactor = std::make_shared<Reactor>(context, mailbox_size_, handlers_);
+                Configure(*reactor);
                 this->Register(reactor);
                 return reactor;
             }
 
+            Reactor *CreateInArena(Arena<Reactor> &arena, const Context &context) override {
+                assert(mailbox_size_ > 0);
+                Reactor *reactor = arena.Emplace(context, mailbox_size_, handlers_,
+                                                 MailboxPool(arena));
+                Configure(*reactor);
+                return reactor;
+            }
+
         private:
+            // The rings of passivating reactors come from the heap instead, so that the memory
+            // they free while passivated goes back to the system rather than to the arena.
+            BlockPool *MailboxPool(Arena<Reactor> &arena) {
+                if (segment_pool_ || idle_timeout_ != std::chrono::milliseconds::zero()) {
+                    return nullptr;
+                }
+                return arena.mailbox_pool(mailbox_size_ * sizeof(T));
+            }
+
+            void Configure(Reactor &reactor) {
+                if (segment_pool_) {
+                    reactor.SegmentMailbox(segment_pool_);
+                }
+                if (latency_sample_period_ > 0) {
+                    reactor.SampleLatency(latency_sample_period_,
+                                          this->actor_system().latency_registry());
+                }
+                if (lazy_) {
+                    reactor.Lazy(idle_timeout_);
+                }
+            }
+
+            // Copies of a builder share their handlers until one of them changes a handler.
+            Handlers &mutable_handlers() {
+                auto handlers = std::make_shared<Handlers>(*handlers_);
+                handlers_ = handlers;
+                return *handlers;
+            }
+
             size_type mailbox_size_;
-            std::function<void(const Context &)> on_setup_;
-            std::function<void(const Context &)> on_shutdown_;
-            std::function<void(T &, const Context &)> on_receive_;
+            size_type latency_sample_period_;
+            bool lazy_;
+            std::chrono::milliseconds idle_timeout_;
+            std::shared_ptr<BlockPool> segment_pool_;
+            std::shared_ptr<const Handlers> handlers_;
         };
 
         using size_type = typename bounded_buffer<T>::size_type;
+        using Stamp = typename bounded_buffer<T>::stamp;
 
+        // The mailbox is taken from `mailbox_pool` if it fits into one of its blocks.
         Reactor(const Context &context,
                 size_type mailbox_size,
-                const std::function<void(const Context &)> &on_setup,
-                const std::function<void(const Context &)> &on_shutdown,
-                const std::function<void(T &, const Context &)> &on_receive)
-                : Actor(context, on_setup, on_shutdown), mailbox_(mailbox_size),
-                  on_receive_(on_receive) {}
+                const std::shared_ptr<const Handlers> &handlers,
+                BlockPool *mailbox_pool = nullptr)
+                : Actor(context), mailbox_(mailbox_size, mailbox_pool), handlers_(handlers) {}
+
+        ~Reactor() override {
+            delete tasks_.load(std::memory_order_acquire);
+        }
+
+        void Body() override {
+            SPARKLE_TRACE_THREAD(context_.name(), context_.serial);
+            CurrentContext() = &context_;
+            if (lazy_ && lazy_->set_up) {
+                HandleActivate();
+            } else {
+                HandleSetup();
+                if (lazy_) {
+                    lazy_->set_up = true;
+                }
+            }
+            T message;
+            Stamp stamp;
+            while (true) {
+                RunTasks();
+                Next next = NextMessage(message, stamp);
+                if (next == Next::kInterrupted) {
+                    continue;
+                }
+                if (next == Next::kPassivated) {
+                    return;
+                }
+                if (next == Next::kClosed) {
+                    break;
+                }
+                ++popped_;
+                SPARKLE_TRACE_EVENT(kDequeue, context_.serial);
+                if (restart_requested_.load(std::memory_order_relaxed) &&
+                    restart_requested_.exchange(false, std::memory_order_acquire)) {
+                    Restart();
+                }
+                if (stamp.time != 0) {
+                    RecordLatency(stamp);
+                }
+                SPARKLE_TRACE_EVENT(kHandlerBegin, context_.serial);
+                bool failed = false;
+                try {
+                    Receive(message);
+                } catch (const Simulation::Cancelled &) {
+                    throw;
+                } catch (...) {
+                    if (!supervisor_) {
+                        throw;
+                    }
+                    // Either returns and the reactor restarts, or rethrows.
+                    supervisor_->Fail(*this, std::current_exception());
+                    failed = true;
+                }
+                // Restarts outside of the handler: OnSetup may block, and inside a simulation
+                // another fiber must not run while this one is still handling an exception.
+                if (failed) {
+                    Restart();
+                }
+                SPARKLE_TRACE_EVENT(kHandlerEnd, context_.serial);
+            }
+            RunTasks();
+            HandleShutdown();
+            finished_.store(true, std::memory_order_release);
+            if (lazy_) {
+                std::lock_guard<std::mutex> lock(lazy_->mutex);
+                lazy_->finished = true;
+                lazy_->finished_condition.notify_all();
+            }
+        }
 
         void Run() override {
-            thread_ = std::thread([this] {
-                on_setup_(context_);
-                while (true) {
-                    auto message = this->mailbox_.pop_back();
-                    on_receive_(message, context_);
+            if (lazy_) {
+                Arm(nullptr);
+            } else {
+                Actor::Run();
+            }
+        }
+
+        void Spawn(Simulation &simulation) override {
+            if (lazy_) {
+                Arm(&simulation);
+            } else {
+                Actor::Spawn(simulation);
+            }
+        }
+
+        // Messages sent from now on wait for the reactor to be run again.
+        void Detach(Simulation &simulation) override {
+            if (lazy_ && lazy_->simulation == &simulation) {
+                std::lock_guard<std::mutex> lock(lazy_->mutex);
+                lazy_->simulation = nullptr;
+                lazy_->active.store(true);
+            }
+        }
+
+        void Wait() override {
+            if (!lazy_) {
+                Actor::Wait();
+                return;
+            }
+            std::unique_lock<std::mutex> lock(lazy_->mutex);
+            lazy_->finished_condition.wait(lock, [this] { return lazy_->finished; });
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+        // Lets the reactor finish the messages already in its mailbox, run its shutdown hook and
+        // exit. Sends to a stopped reactor fail.
+        void Stop() {
+            mailbox_.close();
+            if (lazy_) {
+                Activate();
+            }
+        }
+
+        void RequestRestart() override {
+            restart_requested_.store(true, std::memory_order_release);
+        }
+
+        // Returns false, leaving `message` untouched, if the reactor has been stopped.
+        bool Send(const T &message) {
+            SPARKLE_TRACE_EVENT(kSend, context_.serial);
+            if (!mailbox_.push_front(message, latency_ ? Sample() : Stamp(),
+                                     context_.serial)) {
+                return false;
+            }
+            if (lazy_) {
+                Activate();
+            }
+            return true;
+        }
+
+        bool Send(T &&message) {
+            SPARKLE_TRACE_EVENT(kSend, context_.serial);
+            if (!mailbox_.push_front(std::move(message), latency_ ? Sample() : Stamp(),
+                                     context_.serial)) {
+                return false;
+            }
+            if (lazy_) {
+                Activate();
+            }
+            return true;
+        }
+
+        // Whether the reactor has stopped and run its shutdown hook.
+        bool finished() {
+            return finished_.load(std::memory_order_acquire);
+        }
+
+        // Runs `task` on the reactor's thread once it has handled the messages sent so far,
+        // starting or waking the reactor if needed. Tasks posted after it finished never run.
+        void Post(std::function<void()> task) {
+            Tasks *tasks = tasks_.load(std::memory_order_acquire);
+            if (tasks == nullptr) {
+                std::unique_ptr<Tasks> created(new Tasks());
+                if (tasks_.compare_exchange_strong(tasks, created.get())) {
+                    tasks = created.release();
                 }
+            }
+            {
+                std::lock_guard<std::mutex> lock(tasks->mutex);
+                tasks->pending.push_back({mailbox_.pushed(), std::move(task)});
+                tasks->count.fetch_add(1, std::memory_order_release);
+            }
+            mailbox_.interrupt();
+            if (lazy_) {
+                Activate();
+            }
+        }
+
+        // Once the reactor has handled the messages sent so far, hands the keys in `move` over
+        // to `to`, see StatefulReactor::Builder::OnHandOff. `done` runs on the thread of `to`
+        // once it has taken them over.
+        void HandOff(Reactor &to, const KeyMove &move, const std::function<void()> &done) {
+            Post([this, &to, move, done] {
+                std::shared_ptr<void> handed_off = HandleHandOff(move);
+                to.Post([&to, handed_off, move, done] {
+                    to.HandleTakeOver(handed_off, move);
+                    done();
+                });
             });
         }
 
-        void Wait() override {
-            thread_.join();
+        size_type mailbox_depth() {
+            return mailbox_.size();
         }
 
-        void Send(const T &message) {
-            mailbox_.push_front(message);
+        size_type mailbox_capacity() {
+            return mailbox_.capacity();
         }
 
-        void Send(T &&message) {
-            mailbox_.push_front(std::move(message));
+        // Total time spent in OnReceive since MeasureBusyTime() was called, in virtual time inside
+        // a simulation.
+        int64_t busy_time() {
+            return busy_time_.load(std::memory_order_relaxed);
+        }
+
+        void MeasureBusyTime() {
+            measure_busy_time_.store(true, std::memory_order_relaxed);
+        }
+
+        // Keeps the mailbox in segments of `pool`, see bounded_buffer::segment. Must be called
+        // before the reactor receives its first message.
+        void SegmentMailbox(const std::shared_ptr<BlockPool> &pool) {
+            mailbox_.segment(pool);
+        }
+
+        // Must be called before the reactor receives its first message.
+        void SampleLatency(size_type period, LatencyRegistry &registry) {
+            if (period == 0) {
+                latency_.reset();
+                return;
+            }
+            latency_.reset(new LatencySampling(registry, period));
+        }
+
+        // Starts the reactor with its first message instead of with the actor system. If
+        // `idle_timeout` is not zero, the reactor passivates once its mailbox stayed empty that
+        // long: its body exits, its mailbox storage is freed, and the next message starts it
+        // again. OnSetup only runs the first time. Must be called before the reactor is
+        // registered.
+        void Lazy(std::chrono::nanoseconds idle_timeout = std::chrono::nanoseconds::zero()) {
+            lazy_.reset(new Lifecycle());
+            lazy_->idle_timeout = idle_timeout;
         }
 
     protected:
-        std::function<void(T &, const Context &)> on_receive_;
+        // Drops the state of a failed reactor before it is set up again.
+        virtual void Reset() {}
+
+        virtual void HandleSetup() {
+            handlers_->on_setup(context_);
+        }
+
+        virtual void HandleShutdown() {
+            handlers_->on_shutdown(context_);
+        }
+
+        virtual void HandleReceive(T &message) {
+            handlers_->on_receive(message, context_);
+        }
+
+        // Called by a lazy reactor before it passivates, and when it starts again.
+        virtual void HandlePassivate() {}
+
+        virtual void HandleActivate() {}
+
+        // Called by a member of an elastic group when the keys in `move` leave it. Returns what
+        // their new owner gets in HandleTakeOver.
+        virtual std::shared_ptr<void> HandleHandOff(const KeyMove &move) {
+            return nullptr;
+        }
+
+        virtual void HandleTakeOver(const std::shared_ptr<void> &handed_off, const KeyMove &move) {}
 
     private:
-        std::thread thread_;
+        enum class Next {
+            kMessage,
+            kClosed,
+            kPassivated,
+            kInterrupted,
+        };
+
+        struct Task {
+            // Runs once this many messages have been popped.
+            uint64_t mark;
+            std::function<void()> run;
+        };
+
+        // Only allocated by the first Post.
+        struct Tasks {
+            std::mutex mutex;
+            std::vector<Task> pending;
+            std::atomic<std::size_t> count{0};
+        };
+
+        // Only allocated for lazy reactors.
+        struct Lifecycle {
+            std::chrono::nanoseconds idle_timeout{0};
+            // Whether a body is running or about to be started. Whoever flips it from false to
+            // true starts the next body. Also true while the reactor is not run by the system,
+            // before Start or Simulate and after a simulation ended, so that messages wait.
+            std::atomic<bool> active{true};
+            Simulation *simulation = nullptr;
+            // Only touched by bodies, which never overlap.
+            bool set_up = false;
+            std::mutex mutex;
+            std::condition_variable finished_condition;
+            bool finished = false;
+        };
+
+        struct LatencySampling {
+            LatencySampling(LatencyRegistry &registry, size_type period)
+                    : registry(registry), period(period) {}
+
+            LatencyRegistry &registry;
+            const size_type period;
+            std::atomic<size_type> sent{0};
+            std::mutex mutex;
+            // Histogram per sender serial, 0 for messages from outside any actor.
+            std::unordered_map<uint64_t, LatencyHistogram *> edges;
+        };
+
+        void Receive(T &message) {
+            if (measure_busy_time_.load(std::memory_order_relaxed)) {
+                auto begin = Now();
+                HandleReceive(message);
+                busy_time_.fetch_add((Now() - begin).count(), std::memory_order_relaxed);
+            } else {
+                HandleReceive(message);
+            }
+        }
+
+        Next NextMessage(T &message, Stamp &stamp) {
+            auto timeout = std::chrono::nanoseconds::max();
+            if (lazy_ && lazy_->idle_timeout != std::chrono::nanoseconds::zero()) {
+                timeout = lazy_->idle_timeout;
+            }
+            using pop_status = typename bounded_buffer<T>::pop_status;
+            while (true) {
+                pop_status status = mailbox_.pop_back(message, stamp, timeout);
+                if (status == pop_status::popped) {
+                    return Next::kMessage;
+                }
+                if (status == pop_status::closed) {
+                    return Next::kClosed;
+                }
+                if (status == pop_status::interrupted) {
+                    return Next::kInterrupted;
+                }
+                if (Passivate()) {
+                    return Next::kPassivated;
+                }
+            }
+        }
+
+        // Returns false if a message arrived meanwhile and this body keeps running.
+        bool Passivate() {
+            HandlePassivate();
+            std::unique_lock<std::mutex> lock(lazy_->mutex);
+            lazy_->active.store(false);
+            // A sender that pushes after this sees active == false and starts a new body, once
+            // this one let go of the lock. If the CAS fails, a sender was faster and the new body
+            // takes the state over.
+            bool expected = false;
+            if (mailbox_.release() || !lazy_->active.compare_exchange_strong(expected, true)) {
+                // Nobody joins a passivated body, so its thread and stack go away as it exits.
+                if (lazy_->simulation == nullptr && thread_.joinable()) {
+                    thread_.detach();
+                }
+                return true;
+            }
+            lock.unlock();
+            HandleActivate();
+            return false;
+        }
+
+        // Called once the system runs the reactor, which from then on starts with messages.
+        void Arm(Simulation *simulation) {
+            lazy_->simulation = simulation;
+            lazy_->active.store(false);
+            if (!mailbox_.release()) {
+                Activate();
+            }
+        }
+
+        void Activate() {
+            if (lazy_->active.load()) {
+                return;
+            }
+            bool expected = false;
+            if (!lazy_->active.compare_exchange_strong(expected, true)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(lazy_->mutex);
+            if (lazy_->simulation != nullptr) {
+                lazy_->simulation->Spawn([this] { Body(); });
+                return;
+            }
+            // The previous body detached from its thread when it passivated.
+            assert(!thread_.joinable());
+            thread_ = std::thread([this] { Body(); });
+        }
+
+        void Restart() {
+            Reset();
+            HandleSetup();
+        }
+
+        // Runs the posted tasks whose messages have all been popped, in the order they were posted.
+        void RunTasks() {
+            Tasks *tasks = tasks_.load(std::memory_order_acquire);
+            if (tasks == nullptr || tasks->count.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+            std::vector<Task> due;
+            {
+                std::lock_guard<std::mutex> lock(tasks->mutex);
+                auto &&pending = tasks->pending;
+                auto first_due = std::stable_partition(
+                        pending.begin(), pending.end(),
+                        [this](const Task &task) { return task.mark > popped_; });
+                due.assign(std::make_move_iterator(first_due),
+                           std::make_move_iterator(pending.end()));
+                pending.erase(first_due, pending.end());
+                tasks->count.fetch_sub(due.size(), std::memory_order_relaxed);
+            }
+            for (auto &&task : due) {
+                task.run();
+            }
+        }
+
+        // Stamps every `period`-th message sent with its send time and the histogram of its
+        // edge. The edge is resolved by the sender, which may be gone once the message is handled.
+        Stamp Sample() {
+            Stamp sampled;
+            if ((latency_->sent.fetch_add(1, std::memory_order_relaxed) + 1) % latency_->period) {
+                return sampled;
+            }
+            const Context *sender = current();
+            {
+                std::lock_guard<std::mutex> lock(latency_->mutex);
+                auto &&histogram = latency_->edges[sender ? sender->serial : 0];
+                if (histogram == nullptr) {
+                    histogram = latency_->registry.Get(sender ? sender->name() : "external",
+                                                       context_.name());
+                }
+                sampled.tag = histogram;
+            }
+            sampled.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            return sampled;
+        }
+
+        void RecordLatency(const Stamp &sampled) {
+            static_cast<LatencyHistogram *>(sampled.tag)->Record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch()).count() -
+                    sampled.time);
+        }
+
         bounded_buffer<T> mailbox_;
+        std::shared_ptr<const Handlers> handlers_;
+        std::unique_ptr<LatencySampling> latency_;
+        std::unique_ptr<Lifecycle> lazy_;
+        std::atomic<bool> measure_busy_time_{false};
+        std::atomic<int64_t> busy_time_{0};
+        std::atomic<bool> restart_requested_{false};
+        std::atomic<bool> finished_{false};
+        std::atomic<Tasks *> tasks_{nullptr};
+        // Only touched by bodies.
+        uint64_t popped_ = 0;
     };
 
 }
@@ -0,0 +1,158 @@
+#ifndef SPARKLE_SEGMENTED_QUEUE_H
+#define SPARKLE_SEGMENTED_QUEUE_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include "block_pool.h"
+
+namespace sparkle {
+
+    /**
+     * FIFO storage made of fixed-size segments, each one block of a shared BlockPool. The queue
+     * takes a segment when the last one fills up and hands segments back as they drain, so an
+     * idle queue holds at most one segment. One drained segment is kept aside while the queue
+     * is not empty, so that a queue hovering around a segment boundary does not go back to the
+     * pool for every segment.
+     *
+     * Not synchronized, bounded_buffer guards it with its own lock.
+     */
+    template<typename T>
+    class segmented_queue {
+    public:
+        using size_type = std::size_t;
+
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Segments cannot over-align items");
+
+        // A pool whose blocks hold `segment_size` items each.
+        static std::shared_ptr<BlockPool> make_pool(size_type segment_size,
+                                                    size_type segments_per_chunk = 256) {
+            assert(segment_size > 0);
+            return std::make_shared<BlockPool>(items_offset() + segment_size * sizeof(T),
+                                               segments_per_chunk);
+        }
+
+        explicit segmented_queue(const std::shared_ptr<BlockPool> &pool)
+                : pool_(pool),
+                  segment_size_((pool->block_size() - items_offset()) / sizeof(T)) {
+            assert(segment_size_ > 0);
+        }
+
+        segmented_queue(const segmented_queue &) = delete;
+
+        segmented_queue &operator=(const segmented_queue &) = delete;
+
+        ~segmented_queue() {
+            while (head_ != nullptr) {
+                for (size_type i = head_->begin; i < head_->end; ++i) {
+                    items(head_)[i].~T();
+                }
+                segment *next = head_->next;
+                pool_->Deallocate(head_);
+                head_ = next;
+            }
+            release_spare();
+        }
+
+        template<typename U>
+        void push_back(U &&item) {
+            if (tail_ == nullptr || tail_->end == segment_size_) {
+                append_segment();
+            }
+            new(items(tail_) + tail_->end) T(std::forward<U>(item));
+            ++tail_->end;
+        }
+
+        // Must not be called on an empty queue.
+        void pop_front(T &result) {
+            assert(head_ != nullptr && head_->begin < head_->end);
+            T &item = items(head_)[head_->begin++];
+            result = std::move(item);
+            item.~T();
+            if (head_->begin < head_->end) {
+                return;
+            }
+            if (head_ == tail_) {
+                // Drained: reuse the segment from its start, and give the spare back.
+                head_->begin = head_->end = 0;
+                release_spare();
+                return;
+            }
+            // Only the tail can be partially filled, so the head is done with.
+            segment *drained = head_;
+            head_ = head_->next;
+            keep_or_release(drained);
+        }
+
+        bool empty() const {
+            return head_ == nullptr || (head_ == tail_ && head_->begin == head_->end);
+        }
+
+        // Gives every segment back to the pool. Must only be called on an empty queue.
+        void release() {
+            assert(empty());
+            if (head_ != nullptr) {
+                pool_->Deallocate(head_);
+                head_ = tail_ = nullptr;
+            }
+            release_spare();
+        }
+
+    private:
+        struct segment {
+            segment *next;
+            size_type begin;
+            size_type end;
+        };
+
+        static constexpr size_type items_offset() {
+            return (sizeof(segment) + alignof(T) - 1) / alignof(T) * alignof(T);
+        }
+
+        static T *items(segment *s) {
+            return reinterpret_cast<T *>(reinterpret_cast<char *>(s) + items_offset());
+        }
+
+        void append_segment() {
+            segment *s = spare_;
+            spare_ = nullptr;
+            if (s == nullptr) {
+                s = static_cast<segment *>(pool_->Allocate());
+            }
+            s->next = nullptr;
+            s->begin = s->end = 0;
+            if (tail_ == nullptr) {
+                head_ = s;
+            } else {
+                tail_->next = s;
+            }
+            tail_ = s;
+        }
+
+        void keep_or_release(segment *s) {
+            if (spare_ == nullptr) {
+                spare_ = s;
+            } else {
+                pool_->Deallocate(s);
+            }
+        }
+
+        void release_spare() {
+            if (spare_ != nullptr) {
+                pool_->Deallocate(spare_);
+                spare_ = nullptr;
+            }
+        }
+
+        std::shared_ptr<BlockPool> pool_;
+        const size_type segment_size_;
+        segment *head_ = nullptr;
+        segment *tail_ = nullptr;
+        segment *spare_ = nullptr;
+    };
+
+}
+
+#endif //SPARKLE_SEGMENTED_QUEUE_H
@@ -0,0 +1,350 @@
+#ifndef SPARKLE_SIMULATION_H
+#define SPARKLE_SIMULATION_H
+
+#include <ucontext.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sparkle {
+
+    /**
+     * Runs actor bodies as fibers on the calling thread. The next fiber to run is picked by a
+     * generator seeded with `seed`, so a given seed always replays the same interleaving. Fibers
+     * switch only when they block on a mailbox, sleep, or are preempted at a mailbox operation,
+     * which happens once every `preempt_one_in` operations on average (never if it is 0).
+     *
+     * Time is virtual: it only advances, instantly, when every fiber is blocked or asleep.
+     */
+    class Simulation {
+    public:
+        using duration = std::chrono::nanoseconds;
+
+        // Thrown into the fibers that are still blocked when the simulation ends, to unwind them.
+        struct Cancelled {
+        };
+
+        explicit Simulation(uint64_t seed,
+                            uint32_t preempt_one_in = 64,
+                            std::size_t stack_size = 256 * 1024)
+                : rng_(seed), preempt_one_in_(preempt_one_in), stack_size_(stack_size) {}
+
+        Simulation(const Simulation &) = delete;
+
+        Simulation &operator=(const Simulation &) = delete;
+
+        // The simulation running on the calling thread, or nullptr.
+        static Simulation *current() {
+            return Current();
+        }
+
+        void Spawn(const std::function<void()> &body) {
+            std::unique_ptr<Fiber> fiber(new Fiber());
+            fiber->body = body;
+            fiber->stack.reset(new char[stack_size_]);
+            getcontext(&fiber->context);
+            fiber->context.uc_stack.ss_sp = fiber->stack.get();
+            fiber->context.uc_stack.ss_size = stack_size_;
+            fiber->context.uc_link = &scheduler_context_;
+            auto address = reinterpret_cast<uintptr_t>(fiber.get());
+            makecontext(&fiber->context, reinterpret_cast<void (*)()>(&Simulation::Trampoline), 2,
+                        static_cast<uint32_t>(address >> 32), static_cast<uint32_t>(address));
+            runnable_.push_back(fiber.get());
+            fiber->index = fibers_.size();
+            fibers_.push_back(std::move(fiber));
+        }
+
+        // Runs until every fiber has finished or is blocked for good. An exception escaping a
+        // fiber is rethrown here.
+        void Run() {
+            Simulation *previous = Current();
+            Current() = this;
+            std::exception_ptr error;
+            while (!error && (!runnable_.empty() || AdvanceTime())) {
+                std::size_t index = static_cast<std::size_t>(rng_() % runnable_.size());
+                Fiber *fiber = runnable_[index];
+                runnable_[index] = runnable_.back();
+                runnable_.pop_back();
+                Resume(fiber);
+                if (fiber->done) {
+                    error = fiber->error;
+                    Destroy(fiber);
+                }
+            }
+            CancelAll();
+            Current() = previous;
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        duration now() const {
+            return now_;
+        }
+
+        // Called by mailbox operations, gives another fiber a chance to run.
+        void Preempt() {
+            if (running_ != nullptr && preempt_one_in_ != 0 && rng_() % preempt_one_in_ == 0) {
+                runnable_.push_back(running_);
+                Switch();
+            }
+        }
+
+        // Blocks the running fiber until Notify(key).
+        void Wait(const void *key) {
+            waiters_[key].push_back(running_);
+            Switch();
+        }
+
+        // Like Wait, but gives up after `time`. Returns false if it timed out.
+        bool WaitFor(const void *key, duration time) {
+            Fiber *fiber = running_;
+            waiters_[key].push_back(fiber);
+            fiber->timed_wait_key = key;
+            fiber->timed_out = false;
+            AddTimer(fiber, time);
+            Switch();
+            return !fiber->timed_out;
+        }
+
+        void Notify(const void *key, bool all) {
+            auto it = waiters_.find(key);
+            if (it == waiters_.end()) {
+                return;
+            }
+            auto &&waiters = it->second;
+            do {
+                Fiber *fiber = waiters.front();
+                waiters.pop_front();
+                if (fiber->timed_wait_key != nullptr) {
+                    fiber->timed_wait_key = nullptr;
+                    CancelTimer(fiber);
+                }
+                runnable_.push_back(fiber);
+            } while (all && !waiters.empty());
+            if (waiters.empty()) {
+                waiters_.erase(it);
+            }
+        }
+
+        void SleepFor(duration time) {
+            AddTimer(running_, time);
+            Switch();
+        }
+
+        // The running fiber no longer keeps the simulation alive while it sleeps, e.g. because
+        // it polls forever.
+        void Background() {
+            running_->background = true;
+        }
+
+        static constexpr std::size_t kLocalSlots = 2;
+
+        // Per-fiber slots, for state that is thread local outside of simulations. Slot 0 holds
+        // the actor context, slot 1 the trace track.
+        const void *&local(std::size_t slot = 0) {
+            return running_ != nullptr ? running_->local[slot] : local_[slot];
+        }
+
+    private:
+        struct Fiber {
+            std::function<void()> body;
+            std::unique_ptr<char[]> stack;
+            ucontext_t context;
+            // Position in fibers_.
+            std::size_t index = 0;
+            uint64_t generation = 0;
+            bool background = false;
+            bool started = false;
+            bool cancelled = false;
+            bool done = false;
+            const void *local[kLocalSlots] = {};
+            // Set while the fiber is in WaitFor.
+            const void *timed_wait_key = nullptr;
+            bool timed_out = false;
+            std::exception_ptr error;
+        };
+
+        struct Timer {
+            duration time;
+            uint64_t sequence;
+            Fiber *fiber;
+            uint64_t generation;
+
+            bool operator>(const Timer &other) const {
+                return time != other.time ? time > other.time : sequence > other.sequence;
+            }
+        };
+
+        static Simulation *&Current() {
+            thread_local Simulation *simulation = nullptr;
+            return simulation;
+        }
+
+        static void Trampoline(uint32_t high, uint32_t low) {
+            auto fiber = reinterpret_cast<Fiber *>((static_cast<uintptr_t>(high) << 32) | low);
+            try {
+                fiber->body();
+            } catch (const Cancelled &) {
+            } catch (...) {
+                fiber->error = std::current_exception();
+            }
+            fiber->done = true;
+        }
+
+        void Resume(Fiber *fiber) {
+            running_ = fiber;
+            fiber->started = true;
+            swapcontext(&scheduler_context_, &fiber->context);
+            running_ = nullptr;
+        }
+
+        void Switch() {
+            Fiber *fiber = running_;
+            swapcontext(&fiber->context, &scheduler_context_);
+            if (fiber->cancelled) {
+                throw Cancelled();
+            }
+        }
+
+        void AddTimer(Fiber *fiber, duration time) {
+            timers_.push({now_ + time, next_timer_++, fiber, ++fiber->generation});
+            if (!fiber->background) {
+                ++sleepers_;
+            }
+        }
+
+        void CancelTimer(Fiber *fiber) {
+            ++fiber->generation;
+            if (!fiber->background) {
+                --sleepers_;
+            }
+        }
+
+        // Wakes the next sleeper, unless only background fibers are left sleeping.
+        bool AdvanceTime() {
+            while (sleepers_ > 0 && !timers_.empty()) {
+                Timer timer = timers_.top();
+                timers_.pop();
+                if (timer.generation != timer.fiber->generation) {
+                    continue;
+                }
+                now_ = std::max(now_, timer.time);
+                if (!timer.fiber->background) {
+                    --sleepers_;
+                }
+                if (const void *key = timer.fiber->timed_wait_key) {
+                    timer.fiber->timed_wait_key = nullptr;
+                    timer.fiber->timed_out = true;
+                    auto &&waiters = waiters_[key];
+                    waiters.erase(std::find(waiters.begin(), waiters.end(), timer.fiber));
+                    if (waiters.empty()) {
+                        waiters_.erase(key);
+                    }
+                }
+                runnable_.push_back(timer.fiber);
+                return true;
+            }
+            return false;
+        }
+
+        void CancelAll() {
+            waiters_.clear();
+            runnable_.clear();
+            timers_ = decltype(timers_)();
+            sleepers_ = 0;
+            while (!fibers_.empty()) {
+                Fiber *fiber = fibers_.back().get();
+                fiber->cancelled = true;
+                // A fiber that swallows Cancelled and blocks again is resumed a few more times,
+                // then abandoned.
+                for (int attempt = 0; attempt < 8 && fiber->started && !fiber->done; ++attempt) {
+                    Resume(fiber);
+                }
+                runnable_.clear();
+                timers_ = decltype(timers_)();
+                Destroy(fiber);
+            }
+        }
+
+        void Destroy(Fiber *fiber) {
+            std::size_t index = fiber->index;
+            std::swap(fibers_[index], fibers_.back());
+            fibers_[index]->index = index;
+            fibers_.pop_back();
+        }
+
+        std::mt19937_64 rng_;
+        const uint32_t preempt_one_in_;
+        const std::size_t stack_size_;
+        ucontext_t scheduler_context_;
+        Fiber *running_ = nullptr;
+        const void *local_[kLocalSlots] = {};
+        std::vector<std::unique_ptr<Fiber>> fibers_;
+        std::vector<Fiber *> runnable_;
+        std::unordered_map<const void *, std::deque<Fiber *>> waiters_;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+        uint64_t next_timer_ = 0;
+        std::size_t sleepers_ = 0;
+        duration now_{0};
+    };
+
+    // Virtual time inside a simulation, and steady clock time otherwise.
+    inline std::chrono::nanoseconds Now() {
+        if (Simulation *simulation = Simulation::current()) {
+            return simulation->now();
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch());
+    }
+
+    // Sleeps in virtual time inside a simulation, and for real otherwise.
+    inline void SleepFor(std::chrono::nanoseconds time) {
+        if (Simulation *simulation = Simulation::current()) {
+            simulation->SleepFor(time);
+        } else {
+            std::this_thread::sleep_for(time);
+        }
+    }
+
+    // Like condition.wait(lock, ready), but inside a simulation blocks the running fiber instead
+    // of the thread.
+    template<typename Predicate>
+    inline void WaitOn(std::unique_lock<std::mutex> &lock, std::condition_variable &condition,
+                       Predicate ready) {
+        Simulation *simulation = Simulation::current();
+        if (simulation == nullptr) {
+            condition.wait(lock, ready);
+            return;
+        }
+        while (!ready()) {
+            lock.unlock();
+            simulation->Wait(&condition);
+            lock.lock();
+        }
+    }
+
+    inline void NotifyOn(std::condition_variable &condition, bool all) {
+        if (Simulation *simulation = Simulation::current()) {
+            simulation->Notify(&condition, all);
+        } else if (all) {
+            condition.notify_all();
+        } else {
+            condition.notify_one();
+        }
+    }
+
+}
+
+#endif //SPARKLE_SIMULATION_H
@@ -13,17 +13,22 @@ namespace sparkle {
 
         using Context = typename Actor::Context;
 
+        // Shared by every producer created from the same builder configuration.
+        struct Handlers {
+            std::function<void(S &, const Context &)> on_setup = [](S &, const Context &) {};
+            std::function<void(S &, const Context &)> on_shutdown = [](S &, const Context &) {};
+            std::function<void(S &, const Context &)> on_run = [](S &, const Context &) {};
+        };
+
         class Builder : public Group<StatefulProducer<S>>::template Builder<Builder> {
         public:
             using BaseBuilder = typename Group<StatefulProducer<S>>::template Builder<Builder>;
 
-            Builder(ActorSystem &actor_system) : BaseBuilder(actor_system),
-                                                 on_setup_([](S &, const Context &) {}),
-                                                 on_shutdown_([](S &, const Context &) {}),
-                                                 on_run_([](S &, const Context &) {}) {}
+            Builder(ActorSystem &actor_system)
+                    : BaseBuilder(actor_system), handlers_(std::make_shared<Handlers>()) {}
 
             Builder OnSetupWithContext(const std::function<void(S &, const Context &)> &on_setup) {
-                on_setup_ = on_setup;
+                mutable_handlers().on_setup = on_setup;
                 return *this;
             }
 
@@ -34,7 +39,7 @@ namespace sparkle {
 
             Builder
             OnShutdownWithContext(const std::function<void(S &, const Context &)> &on_shutdown) {
-                on_shutdown_ = on_shutdown;
+                mutable_handlers().on_shutdown = on_shutdown;
                 return *this;
             }
 
@@ -44,7 +49,7 @@ namespace sparkle {
             }
 
             Builder OnRunWithContext(const std::function<void(S &, const Context &)> &on_run) {
-                on_run_ = on_run;
+                mutable_handlers().on_run = on_run;
                 return *this;
             }
 
@@ -53,32 +58,45 @@ namespace sparkle {
                         [on_run](S &state, const Context &context) { on_run(state); });
             }
 
-            std::shared_ptr<StatefulProducer> CreateWithContext(const Context &context) {
-                auto producer = std::make_shared<StatefulProducer>(
-                        StatefulProducer(context, on_setup_, on_shutdown_, on_run_));
+            std::shared_ptr<StatefulProducer> CreateWithContext(const Context &context) override {
+                auto producer = std::make_shared<StatefulProducer>(context, handlers_);
                 this->Register(producer);
                 return producer;
             }
 
+            StatefulProducer *
+            CreateInArena(Arena<StatefulProducer> &arena, const Context &context) override {
+                return arena.Emplace(context, handlers_);
+            }
+
         private:
-            std::function<void(S &, const Context &)> on_setup_;
-            std::function<void(S &, const Context &)> on_shutdown_;
-            std::function<void(S &, const Context &)> on_run_;
+            Handlers &mutable_handlers() {
+                auto handlers = std::make_shared<Handlers>(*handlers_);
+                handlers_ = handlers;
+                return *handlers;
+            }
+
+            std::shared_ptr<const Handlers> handlers_;
         };
 
-        StatefulProducer(const Context &actor_context,
-                         const std::function<void(S &, const Context &)> &on_setup,
-                         const std::function<void(S &, const Context &)> &on_shutdown,
-                         const std::function<void(S &, const Context &)> &on_run)
-                : Producer(actor_context,
-                           [this, on_setup](const Context &context) { on_setup(state_, context); },
-                           [this, on_shutdown](const Context &context) {
-                               on_shutdown(state_, context);
-                           },
-                           [this, on_run](const Context &context) { on_run(state_, context); }),
-                  state_(S()) {}
+        StatefulProducer(const Context &context, const std::shared_ptr<const Handlers> &handlers)
+                : Producer(context, nullptr), handlers_(handlers), state_(S()) {}
+
+    protected:
+        void HandleSetup() override {
+            handlers_->on_setup(state_, context_);
+        }
+
+        void HandleShutdown() override {
+            handlers_->on_shutdown(state_, context_);
+        }
+
+        void HandleRun() override {
+            handlers_->on_run(state_, context_);
+        }
 
     private:
+        std::shared_ptr<const Handlers> handlers_;
         S state_;
 
     };
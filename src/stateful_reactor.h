@@ -1,6 +1,7 @@
 #ifndef SPARKLE_STATEFUL_REACTOR_H
 #define SPARKLE_STATEFUL_REACTOR_H
 
+#include <string>
 #include "reactor.h"
 
 namespace sparkle {
@@ -13,24 +14,80 @@ namespace sparkle {
 
         using Context = typename Actor::Context;
 
+        // Shared by every reactor created from the same builder configuration.
+        struct Handlers {
+            std::function<void(S &, const Context &)> on_setup = [](S &, const Context &) {};
+            std::function<void(S &, const Context &)> on_shutdown = [](S &, const Context &) {};
+            std::function<void(T &, S &, const Context &)> on_receive =
+                    [](T &, S &, const Context &) {};
+            // Both empty unless the state is serialized while the reactor is passivated.
+            std::function<std::string(const S &)> save;
+            std::function<S(const std::string &)> load;
+            // Both empty unless state moves along with keys between members of an elastic group.
+            std::function<S(S &, const KeyMove &)> on_hand_off;
+            std::function<void(S &, S &, const KeyMove &)> on_take_over;
+        };
+
         class Builder : public Group<StatefulReactor<T, S>>::template Builder<Builder> {
         public:
             using size_type = typename StatefulReactor<T, S>::size_type;
             using BaseBuilder = typename Group<StatefulReactor<T, S>>::template Builder<Builder>;
 
             Builder(ActorSystem &actor_system)
-                    : BaseBuilder(actor_system), mailbox_size_{0},
-                      on_setup_([](S &, const Context &) {}),
-                      on_shutdown_([](S &, const Context &) {}),
-                      on_receive_([](T &, S &, const Context &) {}) {}
+                    : BaseBuilder(actor_system), mailbox_size_{0}, latency_sample_period_{0},
+                      lazy_{false}, idle_timeout_{0}, handlers_(std::make_shared<Handlers>()) {}
 
             Builder MailboxSize(size_type mailbox_size) {
                 mailbox_size_ = mailbox_size;
                 return *this;
             }
 
+            Builder SegmentedMailbox(size_type segment_size) {
+                segment_pool_ = segmented_queue<T>::make_pool(segment_size);
+                return *this;
+            }
+
+            Builder SampleLatency(size_type period) {
+                latency_sample_period_ = period;
+                return *this;
+            }
+
+            Builder Lazy() {
+                lazy_ = true;
+                return *this;
+            }
+
+            Builder PassivateAfter(std::chrono::milliseconds idle_timeout) {
+                lazy_ = true;
+                idle_timeout_ = idle_timeout;
+                return *this;
+            }
+
+            // While passivated, the reactor only keeps `save(state)` and drops the state itself.
+            // `load` rebuilds it when the reactor starts again.
+            Builder SerializeState(const std::function<std::string(const S &)> &save,
+                                   const std::function<S(const std::string &)> &load) {
+                auto &&handlers = mutable_handlers();
+                handlers.save = save;
+                handlers.load = load;
+                return *this;
+            }
+
+            // Called on a member of an elastic group when the keys in `move` leave it, after it
+            // has handled the messages sent to it for them. Returns the part of the state that
+            // goes along, which `on_take_over` merges into the state of the new owner before it
+            // handles any message for those keys.
+            Builder
+            HandOffState(const std::function<S(S &, const KeyMove &)> &on_hand_off,
+                         const std::function<void(S &, S &, const KeyMove &)> &on_take_over) {
+                auto &&handlers = mutable_handlers();
+                handlers.on_hand_off = on_hand_off;
+                handlers.on_take_over = on_take_over;
+                return *this;
+            }
+
             Builder OnSetupWithContext(const std::function<void(S &, const Context &)> &on_setup) {
-                on_setup_ = on_setup;
+                mutable_handlers().on_setup = on_setup;
                 return *this;
             }
 
@@ -41,7 +98,7 @@ namespace sparkle {
 
             Builder
             OnShutdownWithContext(const std::function<void(S &, const Context &)> &on_shutdown) {
-                on_shutdown_ = on_shutdown;
+                mutable_handlers().on_shutdown = on_shutdown;
                 return *this;
             }
 
@@ -52,7 +109,7 @@ namespace sparkle {
 
             Builder
             OnReceiveWithContext(const std::function<void(T &, S &, const Context &)> &on_receive) {
-                on_receive_ = on_receive;
+                mutable_handlers().on_receive = on_receive;
                 return *this;
             }
 
@@ -63,43 +120,114 @@ namespace sparkle {
                         });
             }
 
-            std::shared_ptr<StatefulReactor> CreateWithContext(const Context &context) {
+            std::shared_ptr<StatefulReactor> CreateWithContext(const Context &context) override {
                 assert(mailbox_size_ > 0);
-                auto reactor = std::make_shared<StatefulReactor>(
-                        StatefulReactor(context, mailbox_size_, on_setup_, on_shutdown_,
-                                        on_receive_));
+                auto reactor = std::make_shared<StatefulReactor>(context, mailbox_size_, handlers_);
+                Configure(*reactor);
                 this->Register(reactor);
                 return reactor;
             }
 
+            StatefulReactor *
+            CreateInArena(Arena<StatefulReactor> &arena, const Context &context) override {
+                assert(mailbox_size_ > 0);
+                StatefulReactor *reactor = arena.Emplace(context, mailbox_size_, handlers_,
+                                                         MailboxPool(arena));
+                Configure(*reactor);
+                return reactor;
+            }
+
         private:
+            // See Reactor::Builder::MailboxPool.
+            BlockPool *MailboxPool(Arena<StatefulReactor> &arena) {
+                if (segment_pool_ || idle_timeout_ != std::chrono::milliseconds::zero()) {
+                    return nullptr;
+                }
+                return arena.mailbox_pool(mailbox_size_ * sizeof(T));
+            }
+
+            void Configure(StatefulReactor &reactor) {
+                if (segment_pool_) {
+                    reactor.SegmentMailbox(segment_pool_);
+                }
+                if (latency_sample_period_ > 0) {
+                    reactor.SampleLatency(latency_sample_period_,
+                                          this->actor_system().latency_registry());
+                }
+                if (lazy_) {
+                    reactor.Lazy(idle_timeout_);
+                }
+            }
+
+            Handlers &mutable_handlers() {
+                auto handlers = std::make_shared<Handlers>(*handlers_);
+                handlers_ = handlers;
+                return *handlers;
+            }
+
             size_type mailbox_size_;
-            std::function<void(S &, const Context &)> on_setup_;
-            std::function<void(S &, const Context &)> on_shutdown_;
-            std::function<void(T &, S &, const Context &)> on_receive_;
+            size_type latency_sample_period_;
+            bool lazy_;
+            std::chrono::milliseconds idle_timeout_;
+            std::shared_ptr<BlockPool> segment_pool_;
+            std::shared_ptr<const Handlers> handlers_;
         };
 
-        StatefulReactor(const Context &actor_context,
+        StatefulReactor(const Context &context,
                         typename Reactor<T>::size_type mailbox_size,
-                        const std::function<void(S &, const Context &)> &on_setup,
-                        const std::function<void(S &, const Context &)> &on_shutdown,
-                        const std::function<void(T &, S &, const Context &)> &on_receive)
-                : Reactor<T>(actor_context,
-                             mailbox_size,
-                             [this, on_setup](const Context &context) {
-                                 on_setup(state_, context);
-                             },
-                             [this, on_shutdown](const Context &context) {
-                                 on_shutdown(state_, context);
-                             },
-                             [this, on_receive](T &message, const Context &context) {
-                                 on_receive(message, state_, context);
-                             }),
-                  state_(S()) {
+                        const std::shared_ptr<const Handlers> &handlers,
+                        BlockPool *mailbox_pool = nullptr)
+                : Reactor<T>(context, mailbox_size, nullptr, mailbox_pool), handlers_(handlers),
+                  state_(S()) {}
+
+    protected:
+        void Reset() override {
+            state_ = S();
+        }
+
+        void HandleSetup() override {
+            handlers_->on_setup(state_, this->context_);
+        }
+
+        void HandleShutdown() override {
+            handlers_->on_shutdown(state_, this->context_);
+        }
+
+        void HandleReceive(T &message) override {
+            handlers_->on_receive(message, state_, this->context_);
+        }
+
+        void HandlePassivate() override {
+            if (handlers_->save) {
+                saved_state_.reset(new std::string(handlers_->save(state_)));
+                state_ = S();
+            }
+        }
+
+        void HandleActivate() override {
+            if (saved_state_) {
+                state_ = handlers_->load(*saved_state_);
+                saved_state_.reset();
+            }
+        }
+
+        std::shared_ptr<void> HandleHandOff(const KeyMove &move) override {
+            if (!handlers_->on_hand_off) {
+                return nullptr;
+            }
+            return std::make_shared<S>(handlers_->on_hand_off(state_, move));
+        }
+
+        void HandleTakeOver(const std::shared_ptr<void> &handed_off, const KeyMove &move) override {
+            if (handed_off) {
+                handlers_->on_take_over(state_, *static_cast<S *>(handed_off.get()), move);
+            }
         }
 
     private:
+        std::shared_ptr<const Handlers> handlers_;
         S state_;
+        std::unique_ptr<std::string> saved_state_;
 
     };
 
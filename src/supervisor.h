@@ -0,0 +1,155 @@
+#ifndef SPARKLE_SUPERVISOR_H
+#define SPARKLE_SUPERVISOR_H
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "actor.h"
+
+namespace sparkle {
+
+    /**
+     * Decides what happens when a handler of a supervised actor throws. While fewer than
+     * `max_restarts` restarts happened in the last `within`, the failing actor restarts in place:
+     * it keeps its mailbox, gets fresh state and runs OnSetup again. With kAllForOne the other
+     * children restart as well, before they handle their next message.
+     *
+     * Once the limit is hit, the failure escalates to the parent, which restarts this supervisor's
+     * children (kOneForOne) or all of its own (kAllForOne). A failure that escalates past the
+     * root is rethrown on the actor's thread and terminates the process.
+     */
+    class Supervisor {
+    public:
+        enum class Strategy {
+            kOneForOne,
+            kAllForOne,
+        };
+
+        Supervisor(Strategy strategy,
+                   int32_t max_restarts,
+                   std::chrono::milliseconds within,
+                   const std::shared_ptr<Supervisor> &parent = nullptr)
+                : strategy_(strategy), max_restarts_(max_restarts), within_(within),
+                  parent_(parent) {
+            if (parent_) {
+                std::lock_guard<std::mutex> lock(parent_->mutex_);
+                parent_->subordinates_.push_back(this);
+            }
+        }
+
+        Supervisor(const Supervisor &) = delete;
+
+        Supervisor &operator=(const Supervisor &) = delete;
+
+        ~Supervisor() {
+            if (parent_) {
+                std::lock_guard<std::mutex> lock(parent_->mutex_);
+                auto &&subordinates = parent_->subordinates_;
+                subordinates.erase(std::remove(subordinates.begin(), subordinates.end(), this),
+                                   subordinates.end());
+            }
+        }
+
+        void Configure(Strategy strategy, int32_t max_restarts, std::chrono::milliseconds within) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            strategy_ = strategy;
+            max_restarts_ = max_restarts;
+            within_ = within;
+            restarts_.clear();
+        }
+
+        void Adopt(Actor *actor) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            actors_.push_back(actor);
+        }
+
+        void Adopt(const std::vector<Actor *> &actors) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            actors_.insert(actors_.end(), actors.begin(), actors.end());
+        }
+
+        // Stops supervising an actor that has finished.
+        void Abandon(Actor *actor) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            actors_.erase(std::remove(actors_.begin(), actors_.end(), actor), actors_.end());
+        }
+
+        // Called on the thread of `actor` after its handler threw `error`. Returns if the actor
+        // should restart.
+        void Fail(Actor &actor, std::exception_ptr error) {
+            Strategy strategy;
+            if (AllowRestart(strategy)) {
+                if (strategy == Strategy::kAllForOne) {
+                    RestartChildren(&actor);
+                }
+                return;
+            }
+            Escalate(&actor, error);
+        }
+
+    private:
+        bool AllowRestart(Strategy &strategy) {
+            auto now = Now();
+            std::lock_guard<std::mutex> lock(mutex_);
+            strategy = strategy_;
+            while (!restarts_.empty() && now - restarts_.front() > within_) {
+                restarts_.pop_front();
+            }
+            if (static_cast<int32_t>(restarts_.size()) >= max_restarts_) {
+                return false;
+            }
+            restarts_.push_back(now);
+            return true;
+        }
+
+        void Escalate(Actor *failed, std::exception_ptr error) {
+            if (!parent_) {
+                std::rethrow_exception(error);
+            }
+            Strategy strategy;
+            if (parent_->AllowRestart(strategy)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    restarts_.clear();
+                }
+                if (strategy == Strategy::kAllForOne) {
+                    parent_->RestartChildren(failed);
+                } else {
+                    RestartChildren(failed);
+                }
+                return;
+            }
+            parent_->Escalate(failed, error);
+        }
+
+        // `failed` restarts by itself right after the supervisor returns.
+        void RestartChildren(Actor *failed) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &&actor : actors_) {
+                if (actor != failed) {
+                    actor->RequestRestart();
+                }
+            }
+            for (auto &&subordinate : subordinates_) {
+                subordinate->RestartChildren(failed);
+            }
+        }
+
+        Strategy strategy_;
+        int32_t max_restarts_;
+        std::chrono::milliseconds within_;
+        std::shared_ptr<Supervisor> parent_;
+        std::mutex mutex_;
+        // Times of the recent restarts, see Now().
+        std::deque<std::chrono::nanoseconds> restarts_;
+        std::vector<Actor *> actors_;
+        std::vector<Supervisor *> subordinates_;
+    };
+
+}
+
+#endif //SPARKLE_SUPERVISOR_H
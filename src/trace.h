@@ -0,0 +1,394 @@
+#ifndef SPARKLE_TRACE_H
+#define SPARKLE_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <boost/circular_buffer.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+#endif
+
+#include "simulation.h"
+
+// Tracing is compiled in only when SPARKLE_TRACE is defined (cmake -DSPARKLE_TRACE=ON).
+// Otherwise the macros below expand to nothing and instrumented code pays nothing.
+#ifdef SPARKLE_TRACE
+#define SPARKLE_TRACE_EVENT(event, arg) \
+    ::sparkle::Tracer::Emit(::sparkle::TraceEvent::event, static_cast<int64_t>(arg))
+#define SPARKLE_TRACE_THREAD(name, id) ::sparkle::Tracer::NameThread(name, id)
+#else
+#define SPARKLE_TRACE_EVENT(event, arg) ((void) 0)
+#define SPARKLE_TRACE_THREAD(name, id) ((void) 0)
+#endif
+
+namespace sparkle {
+
+    enum class TraceEvent : uint8_t {
+        kSend,
+        kEnqueueWaitBegin,
+        kEnqueueWaitEnd,
+        kDequeue,
+        kHandlerBegin,
+        kHandlerEnd,
+        kPark,
+        kUnpark,
+    };
+
+    /**
+     * Collects events from per-thread single-producer rings. Emitting only touches the calling
+     * thread's ring; a background flusher drains the rings so they rarely fill up. Events that
+     * do not fit into a full ring are dropped and counted instead of blocking the actor. Flushed
+     * events are kept up to set_capacity(), by default the latest 2^20 of them (24 MB); older
+     * ones are overwritten and counted as dropped as well.
+     *
+     * Every thread records on its own track. Inside a simulation, every fiber does.
+     */
+    class Tracer {
+    public:
+        struct Record {
+            uint64_t tsc;
+            int64_t arg;
+            int32_t track;
+            TraceEvent event;
+        };
+
+        static Tracer &Instance() {
+            static Tracer tracer;
+            return tracer;
+        }
+
+        static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+        }
+
+        static void Emit(TraceEvent event, int64_t arg) {
+            ThreadBuffer &buffer = LocalBuffer();
+            buffer.Push({Now(), arg, Track(buffer), event});
+        }
+
+        // Names the track of the calling thread or fiber. Events about an actor carry its serial
+        // as their argument; naming the track "name #id" lets them be matched to the receiver.
+        static void NameThread(const std::string &name, uint64_t id) {
+            int32_t track = Track(LocalBuffer());
+            std::string track_name = name + " #" + std::to_string(id);
+            Tracer &tracer = Instance();
+            std::lock_guard<std::mutex> lock(tracer.mutex_);
+            tracer.names_[track] = std::move(track_name);
+        }
+
+        Tracer(const Tracer &) = delete;
+
+        Tracer &operator=(const Tracer &) = delete;
+
+        ~Tracer() {
+            Stop();
+        }
+
+        void Start(std::chrono::milliseconds interval = std::chrono::milliseconds(1)) {
+            std::lock_guard<std::mutex> lock(flusher_mutex_);
+            if (flusher_.joinable()) {
+                return;
+            }
+            stopping_ = false;
+            flusher_ = std::thread([this, interval] {
+                std::unique_lock<std::mutex> lock(flusher_mutex_);
+                while (!stopping_) {
+                    lock.unlock();
+                    Flush();
+                    lock.lock();
+                    stop_.wait_for(lock, interval, [this] { return stopping_; });
+                }
+            });
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lock(flusher_mutex_);
+                if (!flusher_.joinable()) {
+                    return;
+                }
+                stopping_ = true;
+            }
+            stop_.notify_one();
+            flusher_.join();
+            Flush();
+        }
+
+        // Also frees the rings of exited threads once they are drained.
+        void Flush() {
+            std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                buffers = buffers_;
+            }
+            std::lock_guard<std::mutex> lock(records_mutex_);
+            std::vector<ThreadBuffer *> drained;
+            for (auto &&buffer : buffers) {
+                // Read first: a retired thread pushed all of its events before retiring.
+                bool retired = buffer->retired.load(std::memory_order_acquire);
+                buffer->Drain([this](const Record &record) { Keep(record); });
+                if (retired) {
+                    drained.push_back(buffer.get());
+                }
+            }
+            if (!drained.empty()) {
+                Reap(drained);
+            }
+        }
+
+        // Keeps at most `capacity` flushed events, the latest ones.
+        void set_capacity(std::size_t capacity) {
+            std::lock_guard<std::mutex> lock(records_mutex_);
+            records_capacity_ = capacity;
+            if (records_.capacity() > capacity) {
+                records_.rset_capacity(capacity);
+            }
+        }
+
+        uint64_t dropped() {
+            uint64_t dropped;
+            {
+                std::lock_guard<std::mutex> lock(records_mutex_);
+                dropped = overwritten_;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            dropped += retired_dropped_;
+            for (auto &&buffer : buffers_) {
+                dropped += buffer->dropped.load(std::memory_order_relaxed);
+            }
+            return dropped;
+        }
+
+        /**
+         * Writes everything flushed so far in the Chrome trace event format, which can be opened
+         * with chrome://tracing or https://ui.perfetto.dev.
+         */
+        void WriteChromeTrace(std::ostream &out) {
+            Flush();
+            double ticks_per_us = TicksPerMicrosecond();
+            out << "{\"traceEvents\":[";
+            bool first = true;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &&name : names_) {
+                    out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                        << "\"pid\":1,\"tid\":" << name.first << ",\"args\":{\"name\":\"";
+                    WriteEscaped(out, name.second);
+                    out << "\"}}";
+                    first = false;
+                }
+            }
+            std::lock_guard<std::mutex> lock(records_mutex_);
+            for (auto &&record : records_) {
+                double ts = static_cast<double>(record.tsc - origin_tsc_) / ticks_per_us;
+                out << (first ? "" : ",") << "\n{\"name\":\"" << EventName(record.event)
+                    << "\",\"ph\":\"" << EventPhase(record.event)
+                    << "\",\"pid\":1,\"tid\":" << record.track << ",\"ts\":" << ts;
+                if (EventPhase(record.event)[0] == 'i') {
+                    out << ",\"s\":\"t\"";
+                }
+                out << ",\"args\":{\"arg\":" << record.arg << "}}";
+                first = false;
+            }
+            out << "\n]}\n";
+        }
+
+    private:
+        static constexpr std::size_t kRingCapacity = 1 << 16;
+
+        struct ThreadBuffer {
+            void Push(const Record &record) {
+                uint64_t tail = tail_.load(std::memory_order_relaxed);
+                if (tail - cached_head_ == kRingCapacity) {
+                    cached_head_ = head_.load(std::memory_order_acquire);
+                    if (tail - cached_head_ == kRingCapacity) {
+                        dropped.store(dropped.load(std::memory_order_relaxed) + 1,
+                                      std::memory_order_relaxed);
+                        return;
+                    }
+                }
+                ring_[tail & (kRingCapacity - 1)] = record;
+                tail_.store(tail + 1, std::memory_order_release);
+            }
+
+            template<typename Sink>
+            void Drain(Sink sink) {
+                uint64_t head = head_.load(std::memory_order_relaxed);
+                uint64_t tail = tail_.load(std::memory_order_acquire);
+                for (; head != tail; ++head) {
+                    sink(ring_[head & (kRingCapacity - 1)]);
+                }
+                head_.store(head, std::memory_order_release);
+            }
+
+            int32_t tid = 0;
+            std::atomic<uint64_t> dropped{0};
+            // Set when the thread exits.
+            std::atomic<bool> retired{false};
+
+        private:
+            std::unique_ptr<Record[]> ring_{new Record[kRingCapacity]};
+            alignas(64) std::atomic<uint64_t> tail_{0};
+            uint64_t cached_head_ = 0;
+            alignas(64) std::atomic<uint64_t> head_{0};
+        };
+
+        // Owned by a thread_local, retires the thread's buffer when the thread exits.
+        struct LocalHandle {
+            explicit LocalHandle(const std::shared_ptr<ThreadBuffer> &buffer) : buffer(buffer) {}
+
+            ~LocalHandle() {
+                buffer->retired.store(true, std::memory_order_release);
+            }
+
+            std::shared_ptr<ThreadBuffer> buffer;
+        };
+
+        Tracer() : origin_tsc_(Now()), origin_time_(std::chrono::steady_clock::now()) {}
+
+        static ThreadBuffer &LocalBuffer() {
+            // The tracer keeps a reference so that events of exited threads are still flushed.
+            thread_local LocalHandle handle(Instance().NewBuffer());
+            return *handle.buffer;
+        }
+
+        std::shared_ptr<ThreadBuffer> NewBuffer() {
+            auto buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffer->tid = next_track_++;
+            buffers_.push_back(buffer);
+            return buffer;
+        }
+
+        // The fiber's track inside a simulation, which is kept in its second local slot, and the
+        // thread's otherwise.
+        static int32_t Track(const ThreadBuffer &buffer) {
+            Simulation *simulation = Simulation::current();
+            if (simulation == nullptr) {
+                return buffer.tid;
+            }
+            const void *&slot = simulation->local(1);
+            if (slot == nullptr) {
+                Tracer &tracer = Instance();
+                std::lock_guard<std::mutex> lock(tracer.mutex_);
+                slot = reinterpret_cast<const void *>(static_cast<intptr_t>(tracer.next_track_++));
+            }
+            return static_cast<int32_t>(reinterpret_cast<intptr_t>(slot));
+        }
+
+        // Forgets drained buffers of exited threads, keeping only their drop counts.
+        void Reap(const std::vector<ThreadBuffer *> &drained) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &&buffer : drained) {
+                retired_dropped_ += buffer->dropped.load(std::memory_order_relaxed);
+            }
+            buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(),
+                                          [&drained](const std::shared_ptr<ThreadBuffer> &buffer) {
+                                              return std::find(drained.begin(), drained.end(),
+                                                               buffer.get()) != drained.end();
+                                          }),
+                           buffers_.end());
+        }
+
+        // Grows the flushed events up to records_capacity_, then overwrites the oldest ones.
+        void Keep(const Record &record) {
+            if (records_.full()) {
+                if (records_.capacity() < records_capacity_) {
+                    std::size_t grown = std::max<std::size_t>(records_.capacity() * 2, 1024);
+                    records_.set_capacity(std::min(grown, records_capacity_));
+                } else {
+                    ++overwritten_;
+                }
+            }
+            records_.push_back(record);
+        }
+
+        double TicksPerMicrosecond() {
+            auto elapsed = std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(
+                    std::chrono::steady_clock::now() - origin_time_).count();
+            auto ticks = static_cast<double>(Now() - origin_tsc_);
+            return elapsed > 0 && ticks > 0 ? ticks / elapsed : 1.0;
+        }
+
+        static const char *EventName(TraceEvent event) {
+            switch (event) {
+                case TraceEvent::kSend:
+                    return "send";
+                case TraceEvent::kEnqueueWaitBegin:
+                case TraceEvent::kEnqueueWaitEnd:
+                    return "enqueue_wait";
+                case TraceEvent::kDequeue:
+                    return "dequeue";
+                case TraceEvent::kHandlerBegin:
+                case TraceEvent::kHandlerEnd:
+                    return "handler";
+                case TraceEvent::kPark:
+                case TraceEvent::kUnpark:
+                    return "park";
+            }
+            return "unknown";
+        }
+
+        static const char *EventPhase(TraceEvent event) {
+            switch (event) {
+                case TraceEvent::kEnqueueWaitBegin:
+                case TraceEvent::kHandlerBegin:
+                case TraceEvent::kPark:
+                    return "B";
+                case TraceEvent::kEnqueueWaitEnd:
+                case TraceEvent::kHandlerEnd:
+                case TraceEvent::kUnpark:
+                    return "E";
+                default:
+                    return "i";
+            }
+        }
+
+        static void WriteEscaped(std::ostream &out, const std::string &text) {
+            for (char c : text) {
+                if (c == '"' || c == '\\') {
+                    out << '\\';
+                }
+                out << c;
+            }
+        }
+
+        uint64_t origin_tsc_;
+        std::chrono::steady_clock::time_point origin_time_;
+        std::mutex mutex_;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+        int32_t next_track_ = 1;
+        // Names of threads and fibers by track, kept after they exit.
+        std::map<int32_t, std::string> names_;
+        uint64_t retired_dropped_ = 0;
+        std::mutex records_mutex_;
+        boost::circular_buffer<Record> records_;
+        std::size_t records_capacity_ = 1 << 20;
+        uint64_t overwritten_ = 0;
+        std::mutex flusher_mutex_;
+        std::condition_variable stop_;
+        bool stopping_ = false;
+        std::thread flusher_;
+    };
+
+}
+
+#endif //SPARKLE_TRACE_H